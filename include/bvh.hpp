@@ -0,0 +1,319 @@
+/**
+* @brief Bounding volume hierarchy over boxes
+* @file bvh.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __bvh_hpp__
+#define __bvh_hpp__
+
+#include <cfloat>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "main.hpp"
+#include "geometry.hpp"
+#include "numa.hpp"
+
+struct BoundingBox {
+  BoundingBox() : min(MAX_DISTANCE), max(-MAX_DISTANCE) {}
+  BoundingBox(const glm::vec3 &lo, const glm::vec3 &hi) : min(lo), max(hi) {}
+
+  void Grow(const glm::vec3 &p) { min = glm::min(min, p); max = glm::max(max, p); }
+  void Grow(const BoundingBox &b) { min = glm::min(min, b.min); max = glm::max(max, b.max); }
+  glm::vec3 Centre() const { return (min + max) * 0.5f; }
+
+  // Half the surface area - only ever used as a ratio
+  float Area() const {
+    glm::vec3 e = glm::max(max - min, glm::vec3(0.0f));
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+  }
+
+  glm::vec3 min, max;
+};
+
+// Slab test. True if the ray enters the box before tmax, with the entry distance
+inline bool BoxEnter(const glm::vec3 &min, const glm::vec3 &max, const glm::vec3 &origin, const glm::vec3 &inv_dir,
+    float tmax, float &tnear) {
+  glm::vec3 t1 = (min - origin) * inv_dir;
+  glm::vec3 t2 = (max - origin) * inv_dir;
+  glm::vec3 tlo = glm::min(t1, t2);
+  glm::vec3 thi = glm::max(t1, t2);
+  tnear = glm::max(glm::max(tlo.x, tlo.y), glm::max(tlo.z, 0.0f));
+  float tfar = glm::min(glm::min(thi.x, thi.y), glm::min(thi.z, tmax));
+  return tnear <= tfar;
+}
+
+// 32 bytes, so two siblings share a cache line. Leaves have a count and cover
+// indices [first, first + count). Interior nodes have a count of 0 and their two
+// children sit next to each other at first and first + 1
+
+struct BvhNode {
+  glm::vec3 min;
+  uint32_t first;
+  glm::vec3 max;
+  uint32_t count;
+
+  bool IsLeaf() const { return count > 0; }
+
+  bool Enter(const glm::vec3 &origin, const glm::vec3 &inv_dir, float tmax, float &tnear) const {
+    return BoxEnter(min, max, origin, inv_dir, tmax, tnear);
+  }
+};
+
+// Big trees come from AllocateLarge, so they start on a page
+typedef std::vector<BvhNode, LargeAllocator<BvhNode> > BvhNodes;
+
+// Marks padding in Bvh::indices
+static const uint32_t BVH_PADDING = 0xFFFFFFFFu;
+
+// When refitting has let the SAH cost grow past this multiple of the cost at build
+// time, the tree should be rebuilt
+static const float BVH_REBUILD_COST = 1.5f;
+
+// A spatial build may add at most this fraction of extra triangle references
+static const float SBVH_BUDGET = 0.5f;
+
+// Sibling pairs per block when clustering - 64 pairs of 32 byte nodes is a 4KB page
+static const unsigned int BVH_BLOCK_PAIRS = 64;
+
+// Leaves hold at most leaf_size primitives, and each leaf starts on a multiple of
+// leaf_size in indices, padded out with BVH_PADDING. The primitives can then be laid
+// out in the same order and each leaf tested as one SIMD batch
+
+struct Bvh {
+  Bvh() : leaf_size(1), build_cost(0.0f) {}
+
+  // Build with whichever method options.bvh_build names:
+  //   sah          - binned SAH, the best trees but the slowest to build
+  //   lbvh         - Morton code linear BVH (Karras 2012), built in a few passes
+  //   lbvh-treelet - LBVH, then treelet restructuring to win back SAH quality
+  //
+  // The nodes are then clustered unless options.bvh_layout is depth-first
+  void Build(const std::vector<BoundingBox> &prims, unsigned int leaf_size, const RaytraceOptions &options);
+
+  // Spatial split BVH (Stich et al. 2009) for triangles. As well as splitting the
+  // triangles into two groups, a node may cut space in two, with any triangle crossing
+  // the plane going down both sides clipped to its half. Costs extra references, kept
+  // within SBVH_BUDGET, for far less overlap between nodes over long thin triangles
+  void BuildSpatial(const std::vector<Triangle> &triangles, unsigned int leaf_size, const RaytraceOptions &options);
+
+  // Reorder the nodes so that those a ray visits together are close in memory. Depth
+  // first order puts a node's right child far from its parent, so a ray heading down
+  // the right side touches a new cache line and often a new page at each level.
+  // Instead, sibling pairs are packed into page sized blocks, each filled from its top
+  // pair down in order of surface area - how likely a ray is to get there - with the
+  // pairs left over starting blocks of their own. The root shares the first cache line
+  // with a dummy node, so every pair after it sits on a line of its own
+  void Cluster();
+
+  // Primitive references in the leaves - more than the primitive count after a spatial
+  // build, as crossing triangles appear in more than one leaf
+  size_t References() const;
+
+  // Bytes held by the nodes and indices
+  size_t Memory() const { return nodes.size() * sizeof(BvhNode) + indices.size() * sizeof(uint32_t); }
+
+  // Recompute the bounds from moved primitives, keeping the tree as it is. Works up
+  // from the deepest level, each level split across the render threads
+  void Refit(const std::vector<BoundingBox> &prims, const RaytraceOptions &options);
+
+  // SAH cost of the tree as it is now
+  float Cost() const;
+
+  // Has refitting made the tree bad enough to rebuild?
+  bool Degraded() const { return Cost() > build_cost * BVH_REBUILD_COST; }
+
+  bool Empty() const { return nodes.empty(); }
+
+  // Visit the leaves the ray passes through, nearest first. leaf(first, count) may
+  // shrink tmax as hits are found, and returns true to stop early
+  template <class LeafFunc>
+  void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const;
+
+  BvhNodes nodes;
+  std::vector<uint32_t> indices;                  // Primitive order, with padding
+  std::vector< std::vector<uint32_t> > levels;    // Nodes by depth, for refitting
+  unsigned int leaf_size;
+  float build_cost;
+
+protected:
+  void BuildLbvh(const std::vector<BoundingBox> &prims, const RaytraceOptions &options, bool treelets);
+  void Finish(const std::vector<uint32_t> &order, const std::vector<uint32_t> &depths);
+};
+
+// Compressed form of a finished Bvh, for big meshes whose trees would otherwise
+// outgrow the caches. Each node holds both children's boxes as 8 bit offsets into
+// the node's own box, which is in turn decoded from its parent's, so nothing but the
+// root is stored as floats. Boxes are rounded outwards, so a decoded box always holds
+// the real one and a ray is never wrongly culled - only some extra boxes are entered
+
+// 20 bytes for both children, against 64 for two full BvhNode
+struct CompressedBvhNode {
+  uint8_t lo[2][3];
+  uint8_t hi[2][3];
+  uint32_t child[2];    // Node index, or COMPRESSED_LEAF | the leaf's first index
+};
+
+static const uint32_t COMPRESSED_LEAF = 0x80000000u;
+
+// Size of one quantisation step across a node's box. Widened by a few ulps of the
+// box's coordinates, so that step 255 always reaches the far side after rounding
+inline glm::vec3 QuantisedStep(const BoundingBox &frame) {
+  glm::vec3 size = glm::abs(frame.min) + glm::abs(frame.max);
+  return (frame.max - frame.min + size * (4.0f * FLT_EPSILON)) * (1.0f / 255.0f);
+}
+
+// Box of child c within the frame. Build and traversal both decode through this, so
+// they agree exactly on every frame below the root
+inline BoundingBox QuantisedChild(const CompressedBvhNode &node, int c, const BoundingBox &frame, const glm::vec3 &step) {
+  return BoundingBox(frame.min + glm::vec3(node.lo[c][0], node.lo[c][1], node.lo[c][2]) * step,
+                     frame.min + glm::vec3(node.hi[c][0], node.hi[c][1], node.hi[c][2]) * step);
+}
+
+struct CompressedBvh {
+  CompressedBvh() : root(0), leaf_size(1) {}
+
+  // Quantise the tree. The leaves keep pointing into bvh.indices
+  void Build(const Bvh &bvh);
+
+  // Bytes held by the nodes - the indices stay with the Bvh
+  size_t Memory() const { return nodes.size() * sizeof(CompressedBvhNode); }
+
+  bool Empty() const { return bounds.min.x > bounds.max.x; }
+
+  // As Bvh::Traverse. Every leaf holds a full padded batch of leaf_size
+  template <class LeafFunc>
+  void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const;
+
+  BoundingBox bounds;                       // The root, in full precision
+  uint32_t root;                            // As CompressedBvhNode::child - a lone leaf if the tree is one
+  std::vector<CompressedBvhNode> nodes;
+  unsigned int leaf_size;
+
+protected:
+  uint32_t Emit(const Bvh &bvh, uint32_t n, const BoundingBox &frame);
+};
+
+// Bvh::Traverse over nodes held anywhere, such as a mapped mesh file. There must be
+// at least the root
+template <class LeafFunc>
+void TraverseNodes(const BvhNode *nodes, const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) {
+  glm::vec3 inv_dir = 1.0f / direction;
+  float tnear;
+
+  if (!nodes[0].Enter(origin, inv_dir, tmax, tnear)) {
+    return;
+  }
+
+  // The build keeps the tree shallow enough for this
+  uint32_t stack[64];
+  float stack_near[64];
+  int top = 0;
+  uint32_t node = 0;
+
+  while (true) {
+    const BvhNode &n = nodes[node];
+
+    if (n.IsLeaf()) {
+      if (leaf(n.first, n.count)) {
+        return;
+      }
+    } else {
+      uint32_t a = n.first, b = n.first + 1;
+      float ta, tb;
+      bool hit_a = nodes[a].Enter(origin, inv_dir, tmax, ta);
+      bool hit_b = nodes[b].Enter(origin, inv_dir, tmax, tb);
+
+      if (hit_a && hit_b) {
+        if (tb < ta) {
+          std::swap(a, b);
+          std::swap(ta, tb);
+        }
+        stack[top] = b;
+        stack_near[top++] = tb;
+        node = a;
+        continue;
+      }
+      if (hit_a || hit_b) {
+        node = hit_a ? a : b;
+        continue;
+      }
+    }
+
+    // Skip anything a closer hit has since ruled out
+    do {
+      if (top == 0) return;
+      node = stack[--top];
+    } while (stack_near[top] > tmax);
+  }
+}
+
+template <class LeafFunc>
+void Bvh::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const {
+  if (!nodes.empty()) {
+    TraverseNodes(nodes.data(), origin, direction, tmax, leaf);
+  }
+}
+
+template <class LeafFunc>
+void CompressedBvh::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const {
+  glm::vec3 inv_dir = 1.0f / direction;
+  float tnear;
+
+  if (Empty() || !BoxEnter(bounds.min, bounds.max, origin, inv_dir, tmax, tnear)) {
+    return;
+  }
+
+  // Each entry carries the decoded box of the node it names, as its children's frame
+  uint32_t stack[64];
+  BoundingBox stack_frame[64];
+  float stack_near[64];
+  int top = 0;
+  uint32_t ref = root;
+  BoundingBox frame = bounds;
+
+  while (true) {
+    if (ref & COMPRESSED_LEAF) {
+      if (leaf(ref & ~COMPRESSED_LEAF, leaf_size)) {
+        return;
+      }
+    } else {
+      const CompressedBvhNode &n = nodes[ref];
+      glm::vec3 step = QuantisedStep(frame);
+      BoundingBox a = QuantisedChild(n, 0, frame, step);
+      BoundingBox b = QuantisedChild(n, 1, frame, step);
+      float ta, tb;
+      bool hit_a = BoxEnter(a.min, a.max, origin, inv_dir, tmax, ta);
+      bool hit_b = BoxEnter(b.min, b.max, origin, inv_dir, tmax, tb);
+
+      if (hit_a && hit_b) {
+        int near = tb < ta ? 1 : 0;
+        stack[top] = n.child[1 - near];
+        stack_frame[top] = near ? a : b;
+        stack_near[top++] = near ? ta : tb;
+        ref = n.child[near];
+        frame = near ? b : a;
+        continue;
+      }
+      if (hit_a || hit_b) {
+        ref = n.child[hit_a ? 0 : 1];
+        frame = hit_a ? a : b;
+        continue;
+      }
+    }
+
+    do {
+      if (top == 0) return;
+      ref = stack[--top];
+      frame = stack_frame[top];
+    } while (stack_near[top] > tmax);
+  }
+}
+
+#endif
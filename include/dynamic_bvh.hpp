@@ -0,0 +1,149 @@
+/**
+* @brief Bounding volume hierarchy kept up to date one primitive at a time
+* @file dynamic_bvh.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __dynamic_bvh_hpp__
+#define __dynamic_bvh_hpp__
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+
+// Null node or item
+static const uint32_t DBVH_NULL = 0xFFFFFFFFu;
+
+// Leaves are stored this much bigger than the primitive, as a fraction of its size,
+// so that small moves do not touch the tree at all
+static const float DBVH_MARGIN = 0.1f;
+
+// Past this height the tree is rebuilt by reinserting its leaves in random order.
+// Rotations keep it far shallower than this in practice, and traversal relies on it
+static const uint32_t DBVH_MAX_HEIGHT = 128;
+
+struct DynamicBvhNode {
+  BoundingBox box;
+  uint32_t parent;      // Next free node when on the free list
+  uint32_t child[2];    // DBVH_NULL for leaves
+  uint32_t item;        // What a leaf holds
+  uint32_t height;      // 0 for leaves
+
+  bool IsLeaf() const { return child[0] == DBVH_NULL; }
+};
+
+// One primitive per leaf, in the style of the dynamic AABB trees used by physics
+// engines. A new leaf goes next to whichever node adds the least surface area to the
+// tree, found with a branch and bound search (Bittner et al. 2015), and each node on
+// the way back up tries a rotation (Kopta et al. 2012) that swaps a child with a
+// grandchild if that shrinks the tree. Each edit costs about log n, whatever the size
+// of the scene.
+//
+// Leaves are referred to by the handle Insert gives back, which stays the same until
+// the leaf is removed. Traversal only reads, so any number of threads can trace while
+// nothing is being edited; edits are made between frames, from one thread
+
+struct DynamicBvh {
+  DynamicBvh() : root(DBVH_NULL), free_list(DBVH_NULL), leaves(0) {}
+
+  // Add a primitive with these bounds. Returns its leaf
+  uint32_t Insert(const BoundingBox &box, uint32_t item);
+
+  void Remove(uint32_t leaf);
+
+  // The primitive has moved to these bounds. Only if it has left its leaf's margin is
+  // the leaf taken out and put back in. Returns true if the tree changed
+  bool Update(uint32_t leaf, const BoundingBox &box);
+
+  void SetItem(uint32_t leaf, uint32_t item) { nodes[leaf].item = item; }
+
+  void Clear();
+  bool Empty() const { return root == DBVH_NULL; }
+  size_t Size() const { return leaves; }
+  uint32_t Height() const { return root == DBVH_NULL ? 0 : nodes[root].height; }
+
+  // SAH cost, on the same scale as Bvh::Cost
+  float Cost() const;
+
+  // As Bvh::Traverse, but leaf(item) is called once per primitive
+  template <class LeafFunc>
+  void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const;
+
+  std::vector<DynamicBvhNode> nodes;
+  uint32_t root;
+
+protected:
+  uint32_t Allocate();
+  void Free(uint32_t node);
+  void InsertLeaf(uint32_t leaf);
+  void RemoveLeaf(uint32_t leaf);
+  uint32_t FindSibling(const BoundingBox &box) const;
+  void Refit(uint32_t node);
+  void Rotate(uint32_t node);
+  void Rebalance();
+
+  uint32_t free_list;
+  size_t leaves;
+};
+
+template <class LeafFunc>
+void DynamicBvh::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const {
+  if (root == DBVH_NULL) {
+    return;
+  }
+
+  glm::vec3 inv_dir = 1.0f / direction;
+  float tnear;
+
+  if (!BoxEnter(nodes[root].box.min, nodes[root].box.max, origin, inv_dir, tmax, tnear)) {
+    return;
+  }
+
+  // At most one entry per level is left waiting on the stack
+  uint32_t stack[DBVH_MAX_HEIGHT + 1];
+  float stack_near[DBVH_MAX_HEIGHT + 1];
+  int top = 0;
+  uint32_t node = root;
+
+  while (true) {
+    const DynamicBvhNode &n = nodes[node];
+
+    if (n.IsLeaf()) {
+      if (leaf(n.item)) {
+        return;
+      }
+    } else {
+      uint32_t a = n.child[0], b = n.child[1];
+      float ta, tb;
+      bool hit_a = BoxEnter(nodes[a].box.min, nodes[a].box.max, origin, inv_dir, tmax, ta);
+      bool hit_b = BoxEnter(nodes[b].box.min, nodes[b].box.max, origin, inv_dir, tmax, tb);
+
+      if (hit_a && hit_b) {
+        if (tb < ta) {
+          std::swap(a, b);
+          std::swap(ta, tb);
+        }
+        stack[top] = b;
+        stack_near[top++] = tb;
+        node = a;
+        continue;
+      }
+      if (hit_a || hit_b) {
+        node = hit_a ? a : b;
+        continue;
+      }
+    }
+
+    do {
+      if (top == 0) return;
+      node = stack[--top];
+    } while (stack_near[top] > tmax);
+  }
+}
+
+#endif
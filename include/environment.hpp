@@ -0,0 +1,57 @@
+/**
+* @brief HDR environment maps, lighting the scene from every direction
+* @file environment.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __environment_hpp__
+#define __environment_hpp__
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <glm/glm.hpp>
+
+// An equirectangular HDR image around the scene, in place of the flat sky colour. y
+// is up - the top row is straight up and the middle row the horizon.
+//
+// Most of the light in an outdoor map comes from a few texels around the sun, which a
+// uniform bounce almost never finds. So texels are also picked for sampling in
+// proportion to their luminance times their solid angle, through an alias table
+// (Walker 1977, built as Vose 1991 does). Any texel is then one lookup and one coin
+// flip away, however big the map is
+
+struct Environment {
+  Environment() : width(0), height(0) {}
+
+  // Read a PFM or Radiance HDR (.hdr) file, scaling every texel by scale. Returns
+  // false if the file cannot be read
+  bool Load(const std::string &filename, float scale);
+
+  // Radiance arriving from direction
+  glm::vec3 Lookup(const glm::vec3 &direction) const;
+
+  // Choose a direction to sample, given three numbers in [0,1). Returns it and its
+  // pdf per unit solid angle
+  glm::vec3 Sample(float u1, float u2, float u3, float &pdf) const;
+
+  // pdf per unit solid angle that Sample picks direction with
+  float Pdf(const glm::vec3 &direction) const;
+
+  int width, height;
+  std::vector<glm::vec3> texels;    // Row by row, from the top
+  std::vector<float> prob;          // Alias table - chance of keeping each slot ...
+  std::vector<uint32_t> alias;      // ... and the texel taken if not
+  std::vector<float> texel_pdf;     // Chance of each texel being picked
+
+protected:
+  bool LoadPfm(const std::string &filename);
+  bool LoadHdr(const std::string &filename);
+  void BuildTable();
+  uint32_t Texel(const glm::vec3 &direction, float &sin_theta) const;
+};
+
+#endif
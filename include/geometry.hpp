@@ -19,6 +19,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "math_utils.hpp"
+#include "main.hpp"
 
 // Basic Ray
 
@@ -31,12 +32,18 @@ struct Ray {
   int bounces;              // TODO replace or add energy variable for more realism
 };
 
-// Basic material - shiny phong
+// Basic material - diffuse with a glossy GGX reflection. shiny is the share of light
+// reflected rather than scattered, and the roughness comes from it too, so 1.0 is a
+// mirror and low values are mostly diffuse with a broad sheen. With an index of
+// refraction it is a dielectric instead, such as glass, and shiny is not used
 struct Material {
-  Material() {shiny = 0.45; colour = glm::vec3(1.0,1.0,1.0); }
-  Material (glm::vec3 c, float s) : shiny(s), colour(c) {}
+  Material() {shiny = 0.45; roughness = 1.0f - shiny; colour = glm::vec3(1.0,1.0,1.0); ior = 0.0f; absorption = glm::vec3(0.0f); }
+  Material (glm::vec3 c, float s) : shiny(s), roughness(1.0f - s), colour(c), ior(0.0f), absorption(0.0f) {}
   float shiny;
+  float roughness;          // GGX alpha is its square
   glm::vec3 colour;
+  float ior;                // 0 for opaque materials
+  glm::vec3 absorption;     // Per unit distance travelled inside a dielectric
 };
 
 // Represents a hit on geometry
@@ -46,6 +53,19 @@ struct RayHit{
   glm::vec3 normal;
 };
 
+// What the closest-hit search found, before any hit attributes are worked out.
+// id indexes into the scene list for that type, and sub is the triangle of a mesh
+
+enum HitType { HIT_NONE, HIT_SPHERE, HIT_GROUND, HIT_LIGHT, HIT_MESH };
+
+struct PrimitiveHit {
+  PrimitiveHit() : dist(MAX_DISTANCE), type(HIT_NONE), id(0), sub(0) {}
+  float dist;
+  HitType type;
+  unsigned int id;
+  unsigned int sub;
+};
+
 // Triangle with stored normal
 struct Triangle {
   glm::vec3 v0, v1, v2;
@@ -55,7 +75,8 @@ struct Triangle {
 // Ground Plane
 struct Ground {
   Ground(float g = 0.0f) : height(g) { }
-  bool RayIntersection(const Ray &ray, RayHit &hit);
+  bool Intersect(const Ray &ray, float tmax, float &dist) const;
+  bool Occludes(const Ray &ray, float tmax) const;
 
   float height;
   std::shared_ptr<Material> material;
@@ -63,18 +84,26 @@ struct Ground {
 
 // Sphere
 struct Sphere {
-  Sphere (glm::vec3 c, float r) : centre(c), radius(r) { }
-  bool RayIntersection(const Ray &ray, RayHit &hit); 
+  Sphere (glm::vec3 c, float r) : centre(c), radius(r), start(c), velocity(0.0f) { }
+  bool Intersect(const Ray &ray, float tmax, float &dist) const;
+  bool Occludes(const Ray &ray, float tmax) const;
+  glm::vec3 Normal(const glm::vec3 &loc) const;
+
+  // Distance to the far side for a ray starting inside
+  float Exit(const Ray &ray) const;
 
   glm::vec3 centre;
   float radius;
+  glm::vec3 start;          // Centre on frame 0
+  glm::vec3 velocity;       // Distance moved each frame
   std::shared_ptr<Material> material;
 };
 
 // Light - rendered as a sphere
 struct Light {
   Light (glm::vec3 p, glm::vec3 c, float r) : pos(p), radius(r), colour(c) { };
-  bool RayIntersection(const Ray &ray, RayHit &hit); 
+  bool Intersect(const Ray &ray, float tmax, float &dist) const;
+  bool Occludes(const Ray &ray, float tmax) const;
 
   glm::vec3 colour;
   glm::vec3 pos;
@@ -0,0 +1,114 @@
+/**
+* @brief Uniform grid over boxes, walked with a 3D-DDA
+* @file grid.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __grid_hpp__
+#define __grid_hpp__
+
+#include <stdint.h>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "bvh.hpp"
+
+// Should these go in a grid rather than a tree? Only if their sizes are within a
+// factor of two and their centres fill space about as evenly as random points would.
+// Then there is nothing for a tree to adapt to, and a grid is quicker to build and
+// is walked without a stack
+bool GridSuits(const std::vector<BoundingBox> &prims);
+
+// Cells are stored flat, x fastest. Each cell lists the primitives whose bounds
+// overlap it, so a primitive can appear in several cells
+
+struct Grid {
+
+  // Resolution is picked so there are about GRID_DENSITY primitives per cell, with the
+  // cells as close to cubes as the bounds allow
+  void Build(const std::vector<BoundingBox> &prims);
+
+  bool Empty() const { return cell_start.empty(); }
+  size_t Cells() const { return static_cast<size_t>(res.x) * res.y * res.z; }
+
+  // Walk the cells the ray passes through in order. cell(first, count) is given the
+  // range in items for each non-empty cell, may shrink tmax, and returns true to stop.
+  // We also stop once tmax falls inside the cell just visited, as nothing further on
+  // can be closer
+  template <class CellFunc>
+  void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, CellFunc cell) const;
+
+  BoundingBox bounds;
+  glm::ivec3 res;
+  glm::vec3 cell_size;
+  glm::vec3 inv_cell_size;
+  std::vector<uint32_t> cell_start;   // Cells() + 1 offsets into items
+  std::vector<uint32_t> items;
+};
+
+template <class CellFunc>
+void Grid::Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, CellFunc cell) const {
+  if (cell_start.empty()) {
+    return;
+  }
+
+  glm::vec3 inv_dir = 1.0f / direction;
+  glm::vec3 t1 = (bounds.min - origin) * inv_dir;
+  glm::vec3 t2 = (bounds.max - origin) * inv_dir;
+  glm::vec3 tlo = glm::min(t1, t2);
+  glm::vec3 thi = glm::max(t1, t2);
+  float tenter = glm::max(glm::max(tlo.x, tlo.y), glm::max(tlo.z, 0.0f));
+  float texit = glm::min(glm::min(thi.x, thi.y), thi.z);
+
+  if (tenter > texit || tenter >= tmax) {
+    return;
+  }
+
+  glm::vec3 start = (origin + direction * tenter - bounds.min) * inv_cell_size;
+  glm::ivec3 c = glm::clamp(glm::ivec3(start), glm::ivec3(0), res - 1);
+
+  glm::ivec3 step;
+  glm::vec3 tnext, tdelta;
+  for (int a = 0; a < 3; ++a) {
+    if (direction[a] > 0.0f) {
+      step[a] = 1;
+      tnext[a] = (bounds.min[a] + (c[a] + 1) * cell_size[a] - origin[a]) * inv_dir[a];
+      tdelta[a] = cell_size[a] * inv_dir[a];
+    } else if (direction[a] < 0.0f) {
+      step[a] = -1;
+      tnext[a] = (bounds.min[a] + c[a] * cell_size[a] - origin[a]) * inv_dir[a];
+      tdelta[a] = -cell_size[a] * inv_dir[a];
+    } else {
+      step[a] = 0;
+      tnext[a] = MAX_DISTANCE;
+      tdelta[a] = MAX_DISTANCE;
+    }
+  }
+
+  while (true) {
+    uint32_t idx = (static_cast<uint32_t>(c.z) * res.y + c.y) * res.x + c.x;
+    int axis = tnext.x < tnext.y ? (tnext.x < tnext.z ? 0 : 2) : (tnext.y < tnext.z ? 1 : 2);
+    float tcell_exit = tnext[axis];
+
+    uint32_t first = cell_start[idx];
+    uint32_t count = cell_start[idx + 1] - first;
+    if (count > 0 && cell(first, count)) {
+      return;
+    }
+
+    if (tmax <= tcell_exit || tcell_exit > texit) {
+      return;
+    }
+
+    c[axis] += step[axis];
+    if (c[axis] < 0 || c[axis] >= res[axis]) {
+      return;
+    }
+    tnext[axis] += tdelta[axis];
+  }
+}
+
+#endif
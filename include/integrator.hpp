@@ -0,0 +1,126 @@
+/**
+* @brief Integrators - the different ways of turning rays into pixel colours
+* @file integrator.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __integrator_hpp__
+#define __integrator_hpp__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "scene.hpp"
+#include "tracer.hpp"
+
+// Base for all integrators. Each one has its own loop over the rays for a pixel, so
+// the quick previews dont pay for the supersampling and bounces of the full trace
+
+struct Integrator {
+  virtual ~Integrator() {}
+  virtual std::string Name() const = 0;
+
+  // Called once a frame before any pixels, from the main thread, for integrators that
+  // need the whole frame at once
+  virtual void BeginFrame(const RaytraceOptions &options, const Scene &scene, Cache &cache) {}
+
+  // Colour for the pixel at x,y. shadows is the calling thread's occluder cache
+  virtual glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const = 0;
+};
+
+// Full path tracing - what TraceRay has always done
+struct PathIntegrator : public Integrator {
+  std::string Name() const { return "path"; }
+  glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const;
+};
+
+// First hit only, lit by a shadow ray towards each light
+struct DirectIntegrator : public Integrator {
+  std::string Name() const { return "direct"; }
+  glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const;
+};
+
+// Light candidates per pixel, neighbours merged with each and how many pixels away
+// they can be
+static const int RESTIR_CANDIDATES = 32;
+static const int RESTIR_NEIGHBOURS = 5;
+static const float RESTIR_RADIUS = 10.0f;
+
+// The previous frame counts for at most this many times the current one, so it can
+// never shut out what has changed
+static const float RESTIR_HISTORY = 20.0f;
+
+// Direct lighting by reservoir resampling (ReSTIR, Bitterli et al. 2020). Each pixel
+// streams RESTIR_CANDIDATES light samples through a reservoir, keeping one with odds
+// in proportion to the light it would bring if nothing were in the way. The reservoir
+// is then merged with the one kept at the same surface last frame and with those of a
+// few neighbours whose surfaces are alike, so the sample a pixel ends up with has in
+// effect been picked from hundreds. Only that sample gets a shadow ray.
+//
+// Samples are picked without regard to shadows, so a pixel in partial shadow is still
+// noisy where one ray hits and the next is blocked. The first hits and reservoirs are
+// kept from one frame to the next, so the integrator has to live across frames
+
+struct RestirIntegrator : public Integrator {
+  RestirIntegrator() : width(0), height(0) {}
+  std::string Name() const { return "restir"; }
+  void BeginFrame(const RaytraceOptions &options, const Scene &scene, Cache &cache);
+  glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const;
+
+  // A sample is a light and the two numbers that pick a direction in its cone, rather
+  // than a point on it. Every pixel then draws from the same space, and a sample taken
+  // from a neighbour or from last frame means the same thing here
+  struct Reservoir {
+    Reservoir() : light(-1), w_sum(0.0f), m(0.0f), w(0.0f) {}
+    void Add(int l, const glm::vec2 &u, float weight, float count);
+
+    int light;
+    glm::vec2 sample;
+    float w_sum;                // Sum of the weights seen
+    float m;                    // Number of samples seen
+    float w;                    // Weight of the one kept, standing in for 1 / its pdf
+  };
+
+  // First hit through a pixel. Lights and the sky need no reservoir
+  struct Surface {
+    enum Kind { SKY, EMITTER, DIFFUSE };
+    Kind kind;
+    glm::vec3 loc;
+    glm::vec3 normal;
+    glm::vec3 colour;           // Albedo, or the colour seen for the sky and lights
+    float depth;
+  };
+
+  std::vector<Surface> surfaces, last_surfaces;
+  std::vector<Reservoir> reservoirs, last_reservoirs;
+  mutable std::vector<Reservoir> merged;      // Each Pixel writes only its own
+  glm::mat4 last_view_proj;
+  float last_ffx, last_ffy;
+  int width, height;
+};
+
+// Ambient occlusion - the fraction of the hemisphere above the first hit that is open
+struct AOIntegrator : public Integrator {
+  std::string Name() const { return "ao"; }
+  glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const;
+};
+
+// Single ray through the pixel centre showing depth, normal or albedo at the first hit
+struct PreviewIntegrator : public Integrator {
+  enum Channel { DEPTH, NORMAL, ALBEDO };
+
+  PreviewIntegrator(Channel c) : channel(c) {}
+  std::string Name() const;
+  glm::vec3 Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const;
+
+  Channel channel;
+};
+
+// Create an integrator from its name - path, direct, restir, ao, depth, normal or albedo.
+// Returns nullptr if the name is not known
+std::shared_ptr<Integrator> CreateIntegrator(const std::string &name);
+
+#endif
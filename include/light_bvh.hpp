@@ -0,0 +1,58 @@
+/**
+* @brief Tree over the lights, for finding and sampling them in scenes with many
+* @file light_bvh.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __light_bvh_hpp__
+#define __light_bvh_hpp__
+
+#include <memory>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+
+// Fewer lights than this are just looped over, as they always have been
+static const size_t LIGHT_BVH_MIN = 64;
+
+// A BVH over the light spheres, one light per leaf, with the power below each node.
+// Rays find the lights they hit through it as they do spheres, and a light to sample
+// from a point is picked by walking down it, choosing between each pair of children
+// in proportion to an estimate of how much light they could send to the point: their
+// power over the squared distance, times the best cosine with the surface normal any
+// point in their bounds could have (after Conty Estevez and Kulla 2018). Our lights
+// are spheres and shine every way, so only the receiving side of their orientation
+// bounds counts. Either way the cost is about log n in the number of lights
+
+struct LightBvh {
+
+  void Build(const std::vector< std::shared_ptr<Light> > &lights, const RaytraceOptions &options);
+
+  bool Empty() const { return bvh.Empty(); }
+
+  // Closest light hit before tmax. Returns its index, or -1 with dist untouched
+  int Intersect(const Ray &ray, float tmax, float &dist) const;
+
+  // Any light hit before tmax. Returns its index, or -1
+  int Occludes(const Ray &ray, float tmax) const;
+
+  // Choose a light to sample from loc on a surface with this normal, given u in [0,1).
+  // Returns the light and the probability it was chosen with, or -1 if no light can
+  // reach the point. Lights wholly behind the surface are never chosen
+  int Sample(const glm::vec3 &loc, const glm::vec3 &normal, float u, float &pdf) const;
+
+  Bvh bvh;
+  std::vector<Light> lights;      // Copies, in the scene order
+  std::vector<float> power;       // Below each node
+
+protected:
+  float Importance(uint32_t node, const glm::vec3 &loc, const glm::vec3 &normal) const;
+  float SumPower(uint32_t node);
+};
+
+#endif
@@ -6,6 +6,8 @@
 #include <glm/glm.hpp>
 #include <glm/vec3.hpp>
 
+#include "numa.hpp"
+
 // Cheap return type
 struct BitmapRGB {
   char r;
@@ -15,20 +17,14 @@ struct BitmapRGB {
 
 // Easy buffer type for our final result frame - and also for window viewing
 // We assume throughout that Alpha is there but is always 1.0
+// The pixels are not touched here - each page is placed on the NUMA node of the render
+// thread that first writes to it, and alpha is set as each pixel is written
 
 struct RaytraceBitmap {
   
-  RaytraceBitmap(unsigned int w, unsigned int h) {
+  RaytraceBitmap(unsigned int w, unsigned int h) : data(w * h * 4) {
     width = w;
     height = h;
-
-    for (int i =0; i < width * height * 4; i+=4){
-      data.push_back(0); 
-      data.push_back(0);
-      data.push_back(0);
-      data.push_back(255);
-    }
-
   }
 
   // Set the RGB value - note we save in B G R because that way, we can
@@ -52,7 +48,7 @@ struct RaytraceBitmap {
   };
 
 
-  std::vector<char> data;
+  std::vector<char, LargeAllocator<char> > data;
   unsigned int width;
   unsigned int height;
 };
@@ -68,10 +64,24 @@ typedef struct {
   unsigned int height;
   unsigned int max_bounces;
   unsigned int frame;
+  unsigned int end_frame;
   unsigned int num_rays_per_pixel;  // How many rays per pixel? Related to ray_intensity
   unsigned int supersample;         // How many samples per pixel
   float ray_intensity;              // Usually set to 1.0f. Similar to Gamma. Correct for 10 rays per pixel
   bool live;
+  bool batched;                     // Trace rays a bounce at a time in batches, rather than one by one
+  bool sort_rays;                   // Sort batched rays between bounces for coherence (implies batched)
+  unsigned int threads;             // Number of threads to render with - 0 for all the cores
+  bool thread_pool;                 // Use our own pinned thread pool rather than OpenMP
+  std::string isa;                  // SIMD kernels to use - auto, sse2, sse4.2, avx2 or avx512
+  std::string integrator;           // path, direct, restir, ao, depth, normal or albedo
+  std::string bvh_build;            // sah, lbvh, lbvh-treelet or sbvh
+  std::string bvh_layout;           // Node order - treelet or depth-first
+  std::string accel;                // Sphere accelerator - auto, bvh, grid or dynamic
+  bool compress_bvh;                // Quantise the mesh BVH nodes to 8 bits
+  bool eager_meshes;                // Build every mesh BVH before rendering, not when a ray first reaches it
+  bool out_of_core;                 // Map meshes from built mesh files rather than holding them in memory
+  unsigned int mesh_budget;         // MB of mapped triangles to keep in memory - 0 for no limit
   std::string output_filename;
   std::string scene_filename;
 } RaytraceOptions;
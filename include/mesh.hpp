@@ -0,0 +1,124 @@
+/**
+* @brief Triangle meshes loaded from OBJ files
+* @file mesh.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __mesh_hpp__
+#define __mesh_hpp__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+#include "mesh_file.hpp"
+#include "numa.hpp"
+#include "simd_kernels.hpp"
+
+// Triangles in BVH leaf order as a first vertex and two edges, for the SIMD kernel.
+// Padding triangles have zero edges so they are never hit
+
+struct PackedTriangles {
+  SimdTriangles View(size_t first, size_t count) const;
+
+  std::vector<float, LargeAllocator<float> > v0x, v0y, v0z, e1x, e1y, e1z, e2x, e2y, e2z;
+};
+
+struct Mesh {
+  Mesh() : ready(false) {}
+
+  // Read the triangles from an OBJ file. Polygons are split into fans, and texture
+  // coordinates, normals and materials are ignored. The bounds are found here, so the
+  // mesh can be placed before it is built
+  bool Load(const std::string &filename);
+
+  // Build the BVH (spatial splits if options.bvh_build is sbvh) and pack the triangles,
+  // one SIMD batch per leaf. With options.compress_bvh the nodes are then quantised
+  // and the full precision ones let go
+  void Build(const RaytraceOptions &options, const SimdKernels &kernels);
+
+  // Build, unless another thread already has. Safe to call from any number of render
+  // threads at once - the first one builds, and the others wait on it, while threads
+  // tracing elsewhere carry on. Once built, this is just an atomic load
+  void BuildOnce(const RaytraceOptions &options, const SimdKernels &kernels) {
+    if (!Built()) BuildLocked(options, kernels);
+  }
+
+  bool Built() const { return ready.load(std::memory_order_acquire); }
+
+  // Write the built mesh to a mesh file. Not once the nodes have been compressed
+  bool Save(const std::string &filename) const;
+
+  // Use a mesh file in place of loading and building. Nothing is read until rays reach
+  // it, and then only the parts they reach. Leaves a whole number of kernel widths
+  // wide are tested a width at a time, so a file built for AVX-512 serves AVX2 and SSE
+  // too. Fails with a message if the leaves are narrower than the kernels
+  bool Map(const std::string &filename, const SimdKernels &kernels);
+
+  size_t Size() const { return file ? file->triangles : triangles.size(); }
+
+  // Closest triangle hit before tmax. Returns its index, or -1 with dist untouched.
+  // For a mapped mesh this is its place in the leaf order instead
+  int Intersect(const Ray &ray, const SimdKernels &kernels, float tmax, float &dist) const;
+
+  // Does any triangle block the ray before tmax?
+  bool Occludes(const Ray &ray, const SimdKernels &kernels, float tmax) const;
+
+  BoundingBox Bounds() const { return bounds; }
+
+  // Normal of a triangle Intersect returned
+  glm::vec3 Normal(unsigned int triangle) const { return file ? file->Normal(triangle) : triangles[triangle].normal; }
+
+  std::vector<Triangle> triangles;
+  BoundingBox bounds;
+  std::shared_ptr<Material> material;   // Used by instances that do not set their own
+  Bvh bvh;
+  CompressedBvh compressed;   // Used instead of bvh.nodes if it is not empty
+  PackedTriangles packed;
+  std::shared_ptr<MeshFile> file;       // Mapped meshes keep nothing else in memory
+
+protected:
+  void BuildLocked(const RaytraceOptions &options, const SimdKernels &kernels);
+
+  SimdTriangles Batch(size_t first, size_t count) const {
+    return file ? file->View(first, count) : packed.View(first, count);
+  }
+
+  std::atomic<bool> ready;      // Set once the tree and packed triangles can be read
+  std::mutex build_mutex;
+};
+
+// One placement of a mesh. The triangles and their BVH are shared between every
+// instance of the mesh; rays are moved into the mesh's own space to be tested, so
+// an instance costs a couple of matrices however big the mesh is
+
+struct Instance {
+  Instance(std::shared_ptr<Mesh> m, const glm::mat4 &transform);
+
+  // The ray in mesh space. The direction is not renormalised, so distances along it
+  // are the same as along the world space ray
+  Ray ToMesh(const Ray &ray) const;
+
+  // Normal of a triangle in world space
+  glm::vec3 WorldNormal(unsigned int triangle) const;
+
+  // World space box around the mesh's bounds
+  BoundingBox Bounds() const;
+
+  const Material& GetMaterial() const { return material ? *material : *mesh->material; }
+
+  std::shared_ptr<Mesh> mesh;
+  std::shared_ptr<Material> material;   // Override for this instance, or null
+  glm::mat4 to_world;
+  glm::mat4 to_mesh;
+  glm::mat3 normal_to_world;            // Inverse transpose of to_world
+  bool identity;                        // Placed as loaded, so rays need no transform
+};
+
+#endif
@@ -0,0 +1,95 @@
+/**
+* @brief Built meshes stored in a file and mapped in, for meshes bigger than memory
+* @file mesh_file.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __mesh_file_hpp__
+#define __mesh_file_hpp__
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "geometry.hpp"
+#include "bvh.hpp"
+#include "simd_kernels.hpp"
+
+static const char MESH_FILE_EXTENSION[] = ".rmesh";
+static const uint32_t MESH_FILE_VERSION = 1;
+
+// Unit of residency. The triangles are dropped and faulted back in this many bytes
+// at a time
+static const size_t MESH_CLUSTER_BYTES = 256 * 1024;
+
+// A file holds the BVH nodes, in the order Bvh::Cluster left them, then the triangles
+// one leaf to a block in leaf order. Each block is the leaf's SIMD batch - first
+// vertices, edges and normals as twelve runs of leaf_size floats - so a leaf is read
+// from one place, and leaves near each other in the tree are near each other on disk.
+//
+// Nothing is read up front. The file is mapped and the kernel faults pages in as rays
+// reach them. With a budget set, each cluster of triangles is stamped as rays use it,
+// and once more than the budget has been used the clusters least recently used are
+// dropped from memory and from the page cache, to be read back if needed. The pages
+// are never written, so dropping one under a thread still reading it is safe; it is
+// just read back from the file. The budget covers the triangle blocks, normals
+// included. The nodes are a small part of the file and are left to the kernel
+
+struct MeshFile {
+  MeshFile() : triangles(0), leaf_size(1), nodes(nullptr), blocks(nullptr), base(nullptr), size(0), fd(-1) {}
+  ~MeshFile();
+
+  // Store a built tree and the triangles bvh.indices refers to
+  static bool Write(const std::string &filename, const Bvh &bvh, const std::vector<Triangle> &tris,
+      const BoundingBox &bounds);
+
+  bool Open(const std::string &filename);
+
+  // As Bvh::Traverse, with the same leaves
+  template <class LeafFunc>
+  void Traverse(const glm::vec3 &origin, const glm::vec3 &direction, const float &tmax, LeafFunc leaf) const {
+    TraverseNodes(nodes, origin, direction, tmax, leaf);
+  }
+
+  // The leaf's triangles for the SIMD kernel, marking their cluster as used
+  SimdTriangles View(size_t first, size_t count) const;
+
+  // Normal of the triangle in this slot of the leaf order
+  glm::vec3 Normal(uint32_t slot) const;
+
+  // Bytes of triangles the mapped meshes may keep in memory between them. 0 leaves it
+  // all to the kernel
+  static void SetBudget(size_t bytes);
+
+  // Clusters dropped to keep within the budget so far
+  static size_t Evictions();
+
+  BoundingBox bounds;
+  size_t triangles;
+  unsigned int leaf_size;
+
+protected:
+  static bool WriteBlocks(const std::string &filename, const Bvh &bvh, const std::vector<Triangle> &tris,
+      const BoundingBox &bounds);
+  bool CheckNodes(uint64_t num_nodes, uint64_t slots, uint32_t width) const;
+  void Touch(size_t offset, size_t bytes) const;
+  void Drop(size_t cluster);
+  static void Evict();
+
+  const BvhNode *nodes;
+  const float *blocks;
+  char *base;
+  size_t size;
+  int fd;
+  size_t first_cluster;                                       // Of the triangles
+  std::unique_ptr<std::atomic<uint32_t>[]> stamps;            // Last use, or 0 if not resident
+  size_t clusters;
+};
+
+#endif
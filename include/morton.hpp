@@ -0,0 +1,35 @@
+/**
+* @brief Morton (Z-order) codes for spatial sorting
+* @file morton.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __morton_hpp__
+#define __morton_hpp__
+
+#include <stdint.h>
+#include <glm/glm.hpp>
+
+// Spread the lower 10 bits of v out so there are two zero bits between each one
+
+inline uint32_t ExpandBits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// 30 bit Morton code for a point in the unit cube. Points outside are clamped to the edges
+
+inline uint32_t Morton3D(const glm::vec3 &p) {
+  glm::vec3 q = glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+  uint32_t x = ExpandBits(static_cast<uint32_t>(q.x));
+  uint32_t y = ExpandBits(static_cast<uint32_t>(q.y));
+  uint32_t z = ExpandBits(static_cast<uint32_t>(q.z));
+  return x * 4 + y * 2 + z;
+}
+
+#endif
@@ -0,0 +1,66 @@
+/**
+* @brief NUMA placement and huge page backed allocation
+* @file numa.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __numa_hpp__
+#define __numa_hpp__
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <utility>
+#include <vector>
+
+// NUMA topology is read from /sys/devices/system/node, so we need no libnuma. Machines
+// without it look like a single node
+
+int NumaNodeCount();
+
+// Node of the CPU the calling thread is on. Worked out once per thread, so threads
+// should be pinned (the native thread pool does this) for it to stay correct
+int CurrentNumaNode();
+
+// Run func on a thread pinned to the given node and wait for it. Memory first touched
+// inside func is placed on that node
+void RunOnNumaNode(int node, const std::function<void()> &func);
+
+// Large allocations come straight from mmap and are left untouched, so each page lands
+// on the node of the first thread that writes to it. Anything of 2MB or more is also
+// marked for transparent huge pages, cutting TLB misses. Smaller requests use malloc
+
+void* AllocateLarge(size_t bytes);
+void FreeLarge(void *p, size_t bytes);
+
+// STL allocator on top of AllocateLarge. Elements are default rather than value
+// initialised, so a vector of n chars or floats does not touch its pages up front -
+// mmap memory is zero filled anyway
+
+template <class T>
+struct LargeAllocator {
+  typedef T value_type;
+
+  LargeAllocator() {}
+  template <class U> LargeAllocator(const LargeAllocator<U> &) {}
+
+  T* allocate(size_t n) {
+    void *p = AllocateLarge(n * sizeof(T));
+    if (p == nullptr) throw std::bad_alloc();
+    return static_cast<T*>(p);
+  }
+
+  void deallocate(T *p, size_t n) { FreeLarge(p, n * sizeof(T)); }
+
+  template <class U> struct rebind { typedef LargeAllocator<U> other; };
+
+  template <class U> void construct(U *p) { ::new(static_cast<void*>(p)) U; }
+  template <class U, class... Args> void construct(U *p, Args&&... args) { ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+};
+
+template <class T, class U> bool operator==(const LargeAllocator<T> &, const LargeAllocator<U> &) { return true; }
+template <class T, class U> bool operator!=(const LargeAllocator<T> &, const LargeAllocator<U> &) { return false; }
+
+#endif
@@ -2,21 +2,138 @@
 #define __scene_hpp__
 
 #include <memory>
+#include <stdint.h>
 
 #include "geometry.hpp"
 #include "camera.hpp"
 #include "main.hpp"
+#include "sequence.hpp"
+#include "bvh.hpp"
+#include "grid.hpp"
+#include "dynamic_bvh.hpp"
+#include "light_bvh.hpp"
+#include "environment.hpp"
+#include "mesh.hpp"
+#include "simd_kernels.hpp"
+
+// Remembers the last thing that blocked a shadow ray towards each light. Shadow rays
+// from nearby points to the same light are usually blocked by the same object, so
+// that is tested first. Each thread keeps its own, so there is no locking
+
+struct OccluderCache {
+  OccluderCache(size_t num_lights = 0) : occluders(num_lights), queries(0), hits(0) {}
+
+  // Add the counts from another thread's cache
+  void Merge(const OccluderCache &other) { queries += other.queries; hits += other.hits; }
+  float HitRate() const { return queries > 0 ? static_cast<float>(hits) / queries : 0.0f; }
+
+  std::vector<PrimitiveHit> occluders;  // Last occluder per light - HIT_NONE if there isnt one
+  uint64_t queries;                     // Shadow rays tested through this cache
+  uint64_t hits;                        // ... and those the cached occluder answered
+};
+
+// The spheres again as padded arrays, laid out for the SIMD kernels
+
+struct PackedSpheres {
+  SimdSpheres View() const;
+  SimdSpheres View(size_t first, size_t count) const;
+
+  std::vector<float, LargeAllocator<float> > cx, cy, cz, r2;
+};
 
 // Scene - Collection of all our objects basically
-// http://stackoverflow.com/questions/7477310/why-cant-i-create-a-vector-of-lambda-in-c11
 
 struct Scene {
+
+  // Rebuild the sphere BVH and packed sphere arrays, and pick up the SIMD kernels. Call
+  // this whenever spheres are added or removed. On NUMA machines each node also gets
+  // its own copy of the arrays. The trees over the instances and the lights are rebuilt
+  // each time. Mesh
+  // BVHs are built here with options.eager_meshes, and otherwise by the first ray to
+  // reach each mesh
+  void Pack(const RaytraceOptions &options);
+
+  // Just the packed arrays, in the order the BVH already has
+  void PackSpheres();
+
+  // Move the spheres to where they are on this frame. The BVH is refitted rather than
+  // rebuilt, unless refitting has made it too slow to trace. The dynamic tree just
+  // updates the spheres that moved
+  void Animate(unsigned int frame, const RaytraceOptions &options);
+
+  // Edits for live sessions, made between frames. With options.accel dynamic each one
+  // only touches the dynamic tree along one path, so it costs about log n however big
+  // the scene is; otherwise the whole scene is packed again. Removing a sphere moves
+  // the last one into its place
+  void AddSphere(std::shared_ptr<Sphere> sphere, const RaytraceOptions &options);
+  void RemoveSphere(size_t index, const RaytraceOptions &options);
+  void MoveSphere(size_t index, const glm::vec3 &centre, const RaytraceOptions &options);
+
+  // Copy sphere i into the packed arrays, growing them if need be
+  void WriteSphere(size_t i);
+
+  // Bounds of each sphere, in the scene order
+  std::vector<BoundingBox> SphereBounds() const;
+
+  // Closest sphere hit before tmax, through the grid or BVH if there is one. Returns the index
+  // into spheres, or -1 with dist untouched
+  int IntersectSpheres(const Ray &ray, float tmax, float &dist) const;
+
+  // The packed spheres held on the calling thread's NUMA node
+  const PackedSpheres& LocalSpheres() const;
+
+  // Closest-hit query. Only the distance and the primitive are found, with tmax
+  // shrinking as we go so farther candidates are rejected early
+  bool Intersect(const Ray &ray, float tmax, PrimitiveHit &prim) const;
+
+  // Closest triangle of any mesh instance, filling in prim if it is nearer than tmax.
+  // prim.id is the instance and prim.sub the triangle in its mesh
+  bool IntersectMeshes(const Ray &ray, float tmax, PrimitiveHit &prim) const;
+
+  // Work out the location and normal for a hit found by Intersect,
+  // returning its material. Done once per bounce, for the winner only
+  const Material& HitAttributes(const Ray &ray, const PrimitiveHit &prim, RayHit &hit) const;
+
+  // Light from the sky along direction
+  glm::vec3 Sky(const glm::vec3 &direction) const { return environment ? environment->Lookup(direction) : sky_colour; }
+
+  // Any-hit query for shadow and visibility rays. Returns true as soon as anything
+  // blocks the ray before tmax, without working out where or what was hit
+  bool Occluded(const Ray &ray, float tmax) const;
+
+  // As above, but also reports what blocked the ray
+  bool Occluded(const Ray &ray, float tmax, PrimitiveHit &occluder) const;
+
+  // Shadow ray towards lights[light]. Tries the last occluder for that light first and
+  // only falls back to the full query if it no longer blocks
+  bool Occluded(const Ray &ray, float tmax, unsigned int light, OccluderCache &cache) const;
+
+  // Does this one primitive block the ray before tmax?
+  bool PrimitiveOccludes(const Ray &ray, float tmax, const PrimitiveHit &prim) const;
+
+  // Batched version - occluded is resized to match rays and set to 1 for each blocked ray
+  void Occluded(const std::vector<Ray> &rays, const std::vector<float> &tmax, std::vector<char> &occluded) const;
+
   std::vector< std::shared_ptr<Sphere> >  spheres;  
   std::vector< std::shared_ptr<Light> > lights;
-  std::vector< std::function<bool(const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m)> > intersection_funcs;
   std::shared_ptr<Ground> ground;
+  std::vector< std::shared_ptr<Mesh> > meshes;     // Each loaded once ...
+  std::vector<Instance> instances;                 // ... and placed as many times as needed
   std::shared_ptr<Camera> camera;
   glm::vec3 sky_colour;
+  std::shared_ptr<Environment> environment;   // In place of sky_colour, if there is one
+  CameraPath camera_path;
+
+  Bvh sphere_bvh;             // Only built for scenes with enough spheres to need it
+  Grid sphere_grid;           // ... or this instead, for evenly spread spheres of one size
+  DynamicBvh sphere_tree;     // ... or this, for scenes being edited
+  std::vector<uint32_t> sphere_leaf;  // Leaf in sphere_tree for each sphere
+  Bvh instance_bvh;           // World space bounds of the instances, one per leaf
+  LightBvh light_bvh;         // Only built for scenes with enough lights to need it
+  PackedSpheres packed_spheres;
+  std::vector<PackedSpheres> node_spheres;  // One read-only copy per NUMA node, if more than one
+  const SimdKernels *kernels;
+  RaytraceOptions mesh_options;   // For meshes built mid render, on a single thread
 };
 
 Scene CreateScene(RaytraceOptions &options);
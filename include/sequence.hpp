@@ -0,0 +1,54 @@
+/**
+* @brief Rendering animation sequences in a single process
+* @file sequence.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __sequence_hpp__
+#define __sequence_hpp__
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "main.hpp"
+
+struct Scene;
+
+// A camera keyframe - where the camera is and what it looks at on a given frame
+
+struct CameraKey {
+  float frame;
+  glm::vec3 eye;
+  glm::vec3 look;
+};
+
+// Keyframes sorted by frame. In between we use a Catmull-Rom spline, so the camera
+// passes smoothly through every key. Before the first or after the last key the
+// camera holds still
+
+struct CameraPath {
+  void AddKey(const CameraKey &key);
+  bool Empty() const { return keys.empty(); }
+  void Evaluate(float frame, glm::vec3 &eye, glm::vec3 &look) const;
+
+  std::vector<CameraKey> keys;
+};
+
+// Output file for a frame. A printf style pattern with one %d, %i or %u, such as
+// frame%04d.bmp, is filled in, otherwise the frame number goes before the extension -
+// test.bmp becomes test0012.bmp
+std::string FrameFilename(const std::string &pattern, unsigned int frame);
+
+// Move the scene camera to where the path puts it on this frame
+void PlaceCamera(Scene &scene, unsigned int frame);
+
+// Render frames options.frame to options.end_frame with the scene loaded once. Frames
+// whose output already exists are skipped, and each frame is written out on another
+// thread while the next one renders
+void RenderSequence(const RaytraceOptions &options, Scene &scene);
+
+#endif
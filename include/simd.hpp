@@ -0,0 +1,98 @@
+/**
+* @brief Small SIMD abstraction over the gcc vector extensions
+* @file simd.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+// Only included by the per-ISA kernel files (simd_*.cpp), each compiled with its own
+// -m flags. Everything here is inline and there is no STL or glm, so no out of line
+// copies built for one ISA can be picked up by the linker for code built for another.
+
+#ifndef __simd_hpp__
+#define __simd_hpp__
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef SIMD_NAMESPACE
+#error "Define SIMD_NAMESPACE before including simd.hpp"
+#endif
+
+namespace SIMD_NAMESPACE {
+
+  // W lanes of float, int mask and unsigned int. W is 4 for SSE, 8 for AVX2, 16 for AVX-512.
+  // gcc will not take a vector_size that depends on a template parameter, hence one
+  // specialisation per width
+
+  template <int W> struct SimdTypes;
+
+  template <> struct SimdTypes<4> {
+    typedef float vf __attribute__ ((vector_size (16)));
+    typedef int32_t vi __attribute__ ((vector_size (16)));
+    typedef uint32_t vu __attribute__ ((vector_size (16)));
+  };
+
+  template <> struct SimdTypes<8> {
+    typedef float vf __attribute__ ((vector_size (32)));
+    typedef int32_t vi __attribute__ ((vector_size (32)));
+    typedef uint32_t vu __attribute__ ((vector_size (32)));
+  };
+
+  template <> struct SimdTypes<16> {
+    typedef float vf __attribute__ ((vector_size (64)));
+    typedef int32_t vi __attribute__ ((vector_size (64)));
+    typedef uint32_t vu __attribute__ ((vector_size (64)));
+  };
+
+  template <int W> struct Simd {
+    typedef typename SimdTypes<W>::vf vf;
+    typedef typename SimdTypes<W>::vi vi;
+    typedef typename SimdTypes<W>::vu vu;
+
+    static inline vf Load(const float *p) { vf v; memcpy(&v, p, sizeof(v)); return v; }
+    static inline void Store(float *p, vf v) { memcpy(p, &v, sizeof(v)); }
+    static inline vu LoadU(const uint32_t *p) { vu v; memcpy(&v, p, sizeof(v)); return v; }
+    static inline void StoreU(uint32_t *p, vu v) { memcpy(p, &v, sizeof(v)); }
+
+    static inline vf Set(float f) { vf v; for (int i = 0; i < W; ++i) v[i] = f; return v; }
+    static inline vf Min(vf a, vf b) { return a < b ? a : b; }
+    static inline vf Max(vf a, vf b) { return a > b ? a : b; }
+    static inline vf Select(vi m, vf a, vf b) { return m ? a : b; }
+
+    static inline vf Sqrt(vf a) {
+      for (int i = 0; i < W; ++i) a[i] = __builtin_sqrtf(a[i]);
+      return a;
+    }
+
+    static inline bool Any(vi m) {
+      int32_t r = 0;
+      for (int i = 0; i < W; ++i) r |= m[i];
+      return r != 0;
+    }
+
+    // sin and cos of x in [-PI, PI] by odd / even polynomials after folding into
+    // [-PI/2, PI/2]. Good to around 1e-7, which is plenty for sampling directions
+    static inline vf Sin(vf x) {
+      const float half_pi = 1.57079632679f;
+      const float pi = 3.14159265359f;
+      x = x > half_pi ? pi - x : x;
+      x = x < -half_pi ? -pi - x : x;
+      vf x2 = x * x;
+      return x * (1.0f + x2 * (-1.0f / 6.0f + x2 * (1.0f / 120.0f + x2 * (-1.0f / 5040.0f
+        + x2 * (1.0f / 362880.0f + x2 * (-1.0f / 39916800.0f))))));
+    }
+
+    static inline vf Cos(vf x) {
+      const float half_pi = 1.57079632679f;
+      const float pi = 3.14159265359f;
+      x = x + half_pi;
+      x = x > pi ? x - 2.0f * pi : x;
+      return Sin(x);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+* @brief Hot kernels compiled for each instruction set, picked at startup
+* @file simd_kernels.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __simd_kernels_hpp__
+#define __simd_kernels_hpp__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Plain pointer structs so the kernel files need neither the STL nor glm. Arrays are
+// padded to a multiple of SIMD_MAX_WIDTH with entries that can never be hit
+
+static const size_t SIMD_MAX_WIDTH = 16;
+
+struct SimdRay {
+  float ox, oy, oz;
+  float dx, dy, dz;
+};
+
+struct SimdSpheres {
+  const float *cx, *cy, *cz;
+  const float *r2;              // Radius squared - negative for padding
+  size_t count;                 // Padded count
+};
+
+// Triangles as the first vertex and the two edges leaving it
+struct SimdTriangles {
+  const float *v0x, *v0y, *v0z;
+  const float *e1x, *e1y, *e1z;
+  const float *e2x, *e2y, *e2z;
+  size_t count;
+};
+
+struct SimdBoxes {
+  const float *minx, *miny, *minz;
+  const float *maxx, *maxy, *maxz;  // Padding has max < min
+  size_t count;
+};
+
+// Per-thread random numbers - SIMD_MAX_WIDTH xorshift streams, consumed the same way
+// whatever the vector width so the sequence does not depend on the ISA
+struct SimdRandom {
+  SimdRandom(uint32_t seed = 1);
+  uint32_t state[SIMD_MAX_WIDTH];
+};
+
+struct SimdKernels {
+  const char *isa;
+  int width;
+
+  // Closest sphere with distance in (0, tmax). Returns its index, or -1 with dist untouched
+  int (*intersect_spheres)(const SimdRay &ray, const SimdSpheres &spheres, float tmax, float &dist);
+
+  // Closest triangle with distance in (EPSILON, tmax), two sided
+  int (*intersect_triangles)(const SimdRay &ray, const SimdTriangles &triangles, float tmax, float &dist);
+
+  // Slab test of boxes [first, first + count) - count at most SIMD_MAX_WIDTH. Returns
+  // a bit per box that the ray enters before tmax, with the entry distance in tnear
+  uint32_t (*intersect_boxes)(const SimdRay &inv_ray, const SimdBoxes &boxes, size_t first, size_t count, float tmax, float *tnear);
+
+  // n uniform floats in [0,1). n should be a multiple of SIMD_MAX_WIDTH
+  void (*random_floats)(SimdRandom &rng, float *out, size_t n);
+
+  // n uniform hemisphere directions around the normals, from uniform numbers u1, u2
+  // (same distribution as HemisphereDiffuseRay). Arrays padded to SIMD_MAX_WIDTH
+  void (*sample_hemisphere)(const float *nx, const float *ny, const float *nz, const float *u1, const float *u2,
+    float *dx, float *dy, float *dz, size_t n);
+
+  // Clamp n rgb floats to [0,1] and write them as the BGRA bytes RaytraceBitmap uses
+  void (*tonemap)(const float *rgb, char *bgra, size_t n);
+};
+
+// The kernels for the best instruction set this CPU supports (checked with cpuid on
+// first use) unless SelectSimdKernels has asked for another
+const SimdKernels& GetSimdKernels();
+
+// Force an ISA - auto, sse2, sse4.2, avx2 or avx512. Returns false if the name is not
+// known or the CPU cannot run it, leaving the choice unchanged
+bool SelectSimdKernels(const char *isa);
+
+// Kernel tables, one per ISA source file
+const SimdKernels& SimdKernelsSSE2();
+const SimdKernels& SimdKernelsSSE42();
+const SimdKernels& SimdKernelsAVX2();
+const SimdKernels& SimdKernelsAVX512();
+
+#endif
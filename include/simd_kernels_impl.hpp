@@ -0,0 +1,222 @@
+/**
+* @brief Kernel templates, instantiated once per ISA by the simd_*.cpp files
+* @file simd_kernels_impl.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+// Each including file defines SIMD_NAMESPACE, so the instantiations for each ISA get
+// their own names and the linker can never mix them up
+
+#ifndef __simd_kernels_impl_hpp__
+#define __simd_kernels_impl_hpp__
+
+#include "simd.hpp"
+#include "simd_kernels.hpp"
+
+namespace SIMD_NAMESPACE {
+
+  template <int W>
+  int IntersectSpheres(const SimdRay &ray, const SimdSpheres &spheres, float tmax, float &dist) {
+    typedef Simd<W> S;
+    typedef typename S::vf vf;
+    typedef typename S::vi vi;
+
+    float best = tmax;
+    int best_id = -1;
+
+    for (size_t i = 0; i < spheres.count; i += W) {
+      vf ocx = ray.ox - S::Load(spheres.cx + i);
+      vf ocy = ray.oy - S::Load(spheres.cy + i);
+      vf ocz = ray.oz - S::Load(spheres.cz + i);
+
+      // Same test as SphereRayIntersection - we ignore spheres behind us or hit from inside
+      vf l = ray.dx * ocx + ray.dy * ocy + ray.dz * ocz;
+      vf p = l * l - (ocx * ocx + ocy * ocy + ocz * ocz) + S::Load(spheres.r2 + i);
+      vf dist0 = -l - S::Sqrt(S::Max(p, S::Set(0.0f)));
+      vi hit = (l <= 0.0f) & (p > 0.0f) & (dist0 > 0.0f) & (dist0 < best);
+
+      if (S::Any(hit)) {
+        for (int k = 0; k < W; ++k) {
+          if (hit[k] && dist0[k] < best) {
+            best = dist0[k];
+            best_id = static_cast<int>(i) + k;
+          }
+        }
+      }
+    }
+
+    if (best_id >= 0) dist = best;
+    return best_id;
+  }
+
+  // Moller-Trumbore, as TestTriangle in geometry.cpp
+
+  template <int W>
+  int IntersectTriangles(const SimdRay &ray, const SimdTriangles &tris, float tmax, float &dist) {
+    typedef Simd<W> S;
+    typedef typename S::vf vf;
+    typedef typename S::vi vi;
+
+    const float epsilon = 0.000000001f;
+    float best = tmax;
+    int best_id = -1;
+
+    for (size_t i = 0; i < tris.count; i += W) {
+      vf e1x = S::Load(tris.e1x + i), e1y = S::Load(tris.e1y + i), e1z = S::Load(tris.e1z + i);
+      vf e2x = S::Load(tris.e2x + i), e2y = S::Load(tris.e2y + i), e2z = S::Load(tris.e2z + i);
+
+      vf px = ray.dy * e2z - ray.dz * e2y;
+      vf py = ray.dz * e2x - ray.dx * e2z;
+      vf pz = ray.dx * e2y - ray.dy * e2x;
+      vf det = e1x * px + e1y * py + e1z * pz;
+      vf inv_det = 1.0f / det;
+
+      vf tx = ray.ox - S::Load(tris.v0x + i);
+      vf ty = ray.oy - S::Load(tris.v0y + i);
+      vf tz = ray.oz - S::Load(tris.v0z + i);
+      vf u = (tx * px + ty * py + tz * pz) * inv_det;
+
+      vf qx = ty * e1z - tz * e1y;
+      vf qy = tz * e1x - tx * e1z;
+      vf qz = tx * e1y - ty * e1x;
+      vf v = (ray.dx * qx + ray.dy * qy + ray.dz * qz) * inv_det;
+      vf b = (e2x * qx + e2y * qy + e2z * qz) * inv_det;
+
+      vi hit = ((det > epsilon) | (det < -epsilon)) & (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f)
+        & (u + v <= 1.0f) & (b > epsilon) & (b < best);
+
+      if (S::Any(hit)) {
+        for (int k = 0; k < W; ++k) {
+          if (hit[k] && b[k] < best) {
+            best = b[k];
+            best_id = static_cast<int>(i) + k;
+          }
+        }
+      }
+    }
+
+    if (best_id >= 0) dist = best;
+    return best_id;
+  }
+
+  template <int W>
+  uint32_t IntersectBoxes(const SimdRay &inv_ray, const SimdBoxes &boxes, size_t first, size_t count, float tmax, float *tnear) {
+    typedef Simd<W> S;
+    typedef typename S::vf vf;
+    typedef typename S::vi vi;
+
+    uint32_t mask = 0;
+
+    for (size_t i = 0; i < count; i += W) {
+      size_t b = first + i;
+      vf t1x = (S::Load(boxes.minx + b) - inv_ray.ox) * inv_ray.dx;
+      vf t2x = (S::Load(boxes.maxx + b) - inv_ray.ox) * inv_ray.dx;
+      vf t1y = (S::Load(boxes.miny + b) - inv_ray.oy) * inv_ray.dy;
+      vf t2y = (S::Load(boxes.maxy + b) - inv_ray.oy) * inv_ray.dy;
+      vf t1z = (S::Load(boxes.minz + b) - inv_ray.oz) * inv_ray.dz;
+      vf t2z = (S::Load(boxes.maxz + b) - inv_ray.oz) * inv_ray.dz;
+
+      vf tmin = S::Max(S::Max(S::Min(t1x, t2x), S::Min(t1y, t2y)), S::Max(S::Min(t1z, t2z), S::Set(0.0f)));
+      vf tfar = S::Min(S::Min(S::Max(t1x, t2x), S::Max(t1y, t2y)), S::Min(S::Max(t1z, t2z), S::Set(tmax)));
+      vi hit = tmin <= tfar;
+
+      S::Store(tnear + i, tmin);
+      for (int k = 0; k < W && i + k < count; ++k) {
+        if (hit[k]) mask |= 1u << (i + k);
+      }
+    }
+
+    return mask;
+  }
+
+  template <int W>
+  void RandomFloats(SimdRandom &rng, float *out, size_t n) {
+    typedef Simd<W> S;
+    typedef typename S::vf vf;
+    typedef typename S::vi vi;
+    typedef typename S::vu vu;
+
+    const int groups = SIMD_MAX_WIDTH / W;
+    vu state[SIMD_MAX_WIDTH / W];
+    for (int g = 0; g < groups; ++g) state[g] = S::LoadU(rng.state + g * W);
+
+    for (size_t i = 0; i < n; i += SIMD_MAX_WIDTH) {
+      for (int g = 0; g < groups; ++g) {
+        vu x = state[g];
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        state[g] = x;
+        vf f = __builtin_convertvector((vi)(x >> 8), vf) * (1.0f / 16777216.0f);
+        S::Store(out + i + g * W, f);
+      }
+    }
+
+    for (int g = 0; g < groups; ++g) S::StoreU(rng.state + g * W, state[g]);
+  }
+
+  // z uniform in [0,1] and phi uniform around the normal - uniform over the hemisphere.
+  // The tangents come from the branchless basis of Duff et al. 2017
+
+  template <int W>
+  void SampleHemisphere(const float *nx, const float *ny, const float *nz, const float *u1, const float *u2,
+    float *dx, float *dy, float *dz, size_t n) {
+    typedef Simd<W> S;
+    typedef typename S::vf vf;
+
+    const float pi = 3.14159265359f;
+
+    for (size_t i = 0; i < n; i += W) {
+      vf x = S::Load(nx + i), y = S::Load(ny + i), z = S::Load(nz + i);
+
+      vf sign = S::Select(z >= 0.0f, S::Set(1.0f), S::Set(-1.0f));
+      vf a = -1.0f / (sign + z);
+      vf b = x * y * a;
+      vf ux = 1.0f + sign * x * x * a, uy = sign * b, uz = -sign * x;
+      vf vx = b, vy = sign + y * y * a, vz = -y;
+
+      vf h = S::Load(u1 + i);
+      vf r = S::Sqrt(S::Max(1.0f - h * h, S::Set(0.0f)));
+      vf phi = S::Load(u2 + i) * (2.0f * pi) - pi;
+      vf px = S::Cos(phi) * r;
+      vf py = S::Sin(phi) * r;
+
+      S::Store(dx + i, ux * px + vx * py + x * h);
+      S::Store(dy + i, uy * px + vy * py + y * h);
+      S::Store(dz + i, uz * px + vz * py + z * h);
+    }
+  }
+
+  // Written as a plain loop - with the ISA flags on, the compiler vectorises it
+
+  template <int W>
+  void Tonemap(const float *rgb, char *bgra, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      for (int c = 0; c < 3; ++c) {
+        float v = rgb[i * 3 + 2 - c];
+        v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+        bgra[i * 4 + c] = static_cast<char>(static_cast<int>(v * 255.0f));
+      }
+      bgra[i * 4 + 3] = static_cast<char>(255);
+    }
+  }
+
+  template <int W>
+  SimdKernels MakeKernels(const char *isa) {
+    SimdKernels k;
+    k.isa = isa;
+    k.width = W;
+    k.intersect_spheres = &IntersectSpheres<W>;
+    k.intersect_triangles = &IntersectTriangles<W>;
+    k.intersect_boxes = &IntersectBoxes<W>;
+    k.random_floats = &RandomFloats<W>;
+    k.sample_hemisphere = &SampleHemisphere<W>;
+    k.tonemap = &Tonemap<W>;
+    return k;
+  }
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+/**
+* @brief Native thread pool, as an alternative to OpenMP
+* @file thread_pool.hpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#ifndef __thread_pool_hpp__
+#define __thread_pool_hpp__
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "main.hpp"
+
+// Hands out the indices [0, count) one at a time to whichever thread asks next - the
+// same as an OpenMP dynamic schedule, but usable from either backend
+
+struct WorkQueue {
+  WorkQueue(int count) : next(0), end(count) {}
+  bool Next(int &i) { i = next.fetch_add(1); return i < end; }
+
+  std::atomic<int> next;
+  int end;
+};
+
+// A fixed set of workers that live between frames. Each worker can be pinned to its
+// own core, and Run blocks until every worker has finished the job
+
+class ThreadPool {
+public:
+  ThreadPool(unsigned int num_threads, bool pin);
+  ~ThreadPool();
+
+  // Run job(thread) on every worker - a bit like an omp parallel region
+  void Run(const std::function<void(unsigned int thread)> &job);
+
+  unsigned int size() const { return workers_.size(); }
+
+protected:
+  void Worker(unsigned int thread);
+
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+  const std::function<void(unsigned int)> *job_;
+  unsigned long generation_;
+  unsigned int remaining_;
+  bool quit_;
+};
+
+// Number of threads the options ask for - all the cores if threads is 0
+unsigned int NumThreads(const RaytraceOptions &options);
+
+// Run job(thread) on every thread of whichever backend the options select. The pool
+// is created on first use and kept for later frames
+void RunParallel(const RaytraceOptions &options, const std::function<void(unsigned int thread)> &job);
+
+#endif
@@ -15,6 +15,49 @@
 #include "scene.hpp"
 #include "geometry.hpp"
 
+struct Cache;
+
+// A TraceRay variant, specialised for the features of a scene
+typedef glm::vec3 (*TraceRayFunc)(Ray ray, const RaytraceOptions &options, const Scene &scene, Cache &cache);
+
+// A set of cached values we might need
+struct Cache {
+  glm::mat4 inv_view_proj;
+  float ffx;
+  float ffy;
+  glm::vec3 bounds_min;       // Scene bounds used to give rays a spatial sort key
+  glm::vec3 bounds_inv_size;
+  TraceRayFunc trace_ray;     // TraceRay with anything the scene lacks compiled out
+
+};
+
+void CreateCache(const Scene &scene, const RaytraceOptions &options, Cache &cache);
+
+// Fire a ray from the camera through the point x,y on the screen
+Ray GenerateRay(float x, float y, const RaytraceOptions &options, std::shared_ptr<Camera> camera, Cache &cache);
+
+// Random direction in the hemisphere around normal
+glm::vec3 HemisphereDiffuseRay(const glm::vec3 &normal);
+
+// Bounce the ray off the material at the hit point. Returns how much of the material
+// colour the ray carries on with - 0 if it was lost. inside is set if the ray went
+// into glass, when the caller has to find the way out with Sphere::Exit
+glm::vec3 ScatterRay(Ray &ray, const RayHit &hit, const Material &material, bool &inside);
+
+// Light from the environment map arriving at origin, through one shadow ray in a
+// direction picked from the map, and weighted as a uniform diffuse bounce would see it.
+// With mis set it is weighted against a diffuse bounce finding the same direction
+glm::vec3 EnvironmentLight(const glm::vec3 &origin, const glm::vec3 &normal, const Scene &scene, bool mis);
+
+// Full path trace of a single ray
+glm::vec3 TraceRay(Ray ray, const RaytraceOptions &options, const Scene &scene, Cache &cache);
+
+// Clamp each channel to 1.0
+glm::vec3 maxv (glm::vec3 v);
+
+// All the rays for one pixel, path traced and combined
+glm::vec3 FireRays(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache);
+
 // Our Kernel, given a buffer and the options, creates the scene. 
 void RaytraceKernel(RaytraceBitmap &bitmap, const RaytraceOptions &options, const Scene &scene);
 
@@ -0,0 +1,1095 @@
+/**
+* @brief Bounding volume hierarchy over boxes
+* @file bvh.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <queue>
+
+#include "morton.hpp"
+#include "thread_pool.hpp"
+
+using namespace std;
+
+static const int BVH_BINS = 16;
+
+// Past this depth we split at the object median, which halves the count every level
+// and keeps the tree within the traversal stack whatever the input
+static const unsigned int BVH_MEDIAN_DEPTH = 40;
+
+// Levels smaller than this are refitted on the calling thread
+static const size_t BVH_PARALLEL_LEVEL = 1024;
+
+// Binary radix tree from the LBVH build, with one leaf per primitive. Nodes below
+// num_internal are internal, the rest are leaves in Morton order
+
+struct RadixTree {
+  bool IsLeaf(uint32_t k) const { return k >= num_internal; }
+
+  uint32_t num_internal;
+  std::vector<uint32_t> left, right;    // Children of the internal nodes
+  std::vector<uint32_t> prim;           // Primitive of each leaf
+  std::vector<BoundingBox> bounds;
+  std::vector<uint32_t> count;          // Primitives under each node
+  std::vector<float> cost;              // SAH cost of each subtree
+};
+
+struct BvhBuilder {
+  const std::vector<BoundingBox> &prims;
+  std::vector<glm::vec3> centres;
+  std::vector<uint32_t> order;
+  std::vector<uint32_t> depths;
+  BvhNodes &nodes;
+  unsigned int leaf_size;
+
+  BvhBuilder(const std::vector<BoundingBox> &p, BvhNodes &n, unsigned int ls) : prims(p), nodes(n), leaf_size(ls) {}
+
+  void Split(uint32_t node, uint32_t begin, uint32_t end, unsigned int depth);
+  uint32_t SahPartition(uint32_t begin, uint32_t end, const BoundingBox &centre_bounds);
+  void Emit(const RadixTree &tree, uint32_t node, uint32_t k, uint32_t &next, unsigned int depth);
+  void Gather(const RadixTree &tree, uint32_t k, uint32_t &next);
+};
+
+// Pick the cheapest of the bin boundaries on all three axes and partition around it.
+// Returns the split point, or begin if no boundary separates anything
+
+uint32_t BvhBuilder::SahPartition(uint32_t begin, uint32_t end, const BoundingBox &centre_bounds) {
+  float best_cost = MAX_DISTANCE;
+  int best_axis = -1, best_bin = 0;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = centre_bounds.min[axis];
+    float extent = centre_bounds.max[axis] - lo;
+    if (extent <= 0.0f) continue;
+
+    BoundingBox bins[BVH_BINS];
+    unsigned int counts[BVH_BINS] = {0};
+    float scale = BVH_BINS / extent;
+
+    for (uint32_t i = begin; i < end; ++i) {
+      int b = std::min(BVH_BINS - 1, static_cast<int>((centres[order[i]][axis] - lo) * scale));
+      bins[b].Grow(prims[order[i]]);
+      counts[b]++;
+    }
+
+    // Sweep from the right, then from the left, costing each boundary
+    float right_cost[BVH_BINS];
+    BoundingBox right;
+    unsigned int right_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      right.Grow(bins[b]);
+      right_count += counts[b];
+      right_cost[b] = right.Area() * right_count;
+    }
+
+    BoundingBox left;
+    unsigned int left_count = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      left.Grow(bins[b]);
+      left_count += counts[b];
+      if (left_count == 0 || left_count == end - begin) continue;
+      float cost = left.Area() * left_count + right_cost[b + 1];
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = b;
+      }
+    }
+  }
+
+  if (best_axis < 0) {
+    return begin;
+  }
+
+  float lo = centre_bounds.min[best_axis];
+  float scale = BVH_BINS / (centre_bounds.max[best_axis] - lo);
+  std::vector<uint32_t>::iterator mid = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t p) {
+    return std::min(BVH_BINS - 1, static_cast<int>((centres[p][best_axis] - lo) * scale)) <= best_bin;
+  });
+
+  return static_cast<uint32_t>(mid - order.begin());
+}
+
+void BvhBuilder::Split(uint32_t node, uint32_t begin, uint32_t end, unsigned int depth) {
+  BoundingBox bounds, centre_bounds;
+  for (uint32_t i = begin; i < end; ++i) {
+    bounds.Grow(prims[order[i]]);
+    centre_bounds.Grow(centres[order[i]]);
+  }
+
+  nodes[node].min = bounds.min;
+  nodes[node].max = bounds.max;
+  depths[node] = depth;
+
+  if (end - begin <= leaf_size) {
+    nodes[node].first = begin;
+    nodes[node].count = end - begin;
+    return;
+  }
+
+  uint32_t mid = depth < BVH_MEDIAN_DEPTH ? SahPartition(begin, end, centre_bounds) : begin;
+
+  // Everything in one bin (or too deep) - split at the median of the longest axis
+  if (mid == begin || mid == end) {
+    glm::vec3 extent = centre_bounds.max - centre_bounds.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    mid = begin + (end - begin) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b) {
+      return centres[a][axis] < centres[b][axis];
+    });
+  }
+
+  uint32_t left = nodes.size();
+  nodes.resize(left + 2);
+  depths.resize(left + 2);
+  nodes[node].first = left;
+  nodes[node].count = 0;
+
+  Split(left, begin, mid, depth + 1);
+  Split(left + 1, mid, end, depth + 1);
+}
+
+void Bvh::Build(const std::vector<BoundingBox> &prims, unsigned int size, const RaytraceOptions &options) {
+  nodes.clear();
+  indices.clear();
+  levels.clear();
+  leaf_size = size > 0 ? size : 1;
+
+  if (prims.empty()) {
+    return;
+  }
+
+  if (options.bvh_build == "lbvh" || options.bvh_build == "lbvh-treelet") {
+    BuildLbvh(prims, options, options.bvh_build == "lbvh-treelet");
+
+  } else {
+    BvhBuilder builder(prims, nodes, leaf_size);
+    builder.centres.resize(prims.size());
+    builder.order.resize(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i) {
+      builder.centres[i] = prims[i].Centre();
+      builder.order[i] = i;
+    }
+
+    nodes.reserve(2 * (prims.size() / leaf_size) + 1);
+    nodes.resize(1);
+    builder.depths.resize(1);
+    builder.Split(0, 0, prims.size(), 0);
+
+    Finish(builder.order, builder.depths);
+    build_cost = Cost();
+  }
+
+  if (options.bvh_layout != "depth-first") {
+    Cluster();
+  }
+}
+
+// Lay the leaves out one padded batch each, and group the nodes by depth
+
+void Bvh::Finish(const std::vector<uint32_t> &order, const std::vector<uint32_t> &depths) {
+  indices.clear();
+  levels.clear();
+
+  for (size_t n = 0; n < nodes.size(); ++n) {
+    BvhNode &node = nodes[n];
+    if (node.IsLeaf()) {
+      uint32_t first = indices.size();
+      indices.insert(indices.end(), order.begin() + node.first, order.begin() + node.first + node.count);
+      indices.resize(first + leaf_size, BVH_PADDING);
+      node.first = first;
+      node.count = leaf_size;
+    }
+
+    if (depths[n] >= levels.size()) levels.resize(depths[n] + 1);
+    levels[depths[n]].push_back(n);
+  }
+}
+
+// Linear BVH - sort the primitives along a Morton curve, then read the tree straight
+// off the sorted codes. Every internal node can be found independently, so apart from
+// the radix sort each pass runs across all the render threads
+
+// Common prefix length of sorted keys i and j, or -1 if j is out of range. The keys
+// hold the primitive's position in the low bits, so no two are ever equal
+
+static inline int Delta(const std::vector<uint64_t> &keys, int i, int j) {
+  if (j < 0 || j >= static_cast<int>(keys.size())) return -1;
+  return __builtin_clzll(keys[i] ^ keys[j]);
+}
+
+// Karras 2012 - the range covered by internal node i and where it splits
+
+static void FindChildren(const std::vector<uint64_t> &keys, int i, RadixTree &tree) {
+  int d = Delta(keys, i, i + 1) > Delta(keys, i, i - 1) ? 1 : -1;
+  int delta_min = Delta(keys, i, i - d);
+
+  int lmax = 2;
+  while (Delta(keys, i, i + lmax * d) > delta_min) lmax *= 2;
+
+  int l = 0;
+  for (int t = lmax / 2; t >= 1; t /= 2) {
+    if (Delta(keys, i, i + (l + t) * d) > delta_min) l += t;
+  }
+  int j = i + l * d;
+
+  int delta_node = Delta(keys, i, j);
+  int s = 0;
+  for (int t = (l + 1) / 2; ; t = (t + 1) / 2) {
+    if (Delta(keys, i, i + (s + t) * d) > delta_node) s += t;
+    if (t == 1) break;
+  }
+  int gamma = i + s * d + std::min(d, 0);
+
+  uint32_t n = tree.num_internal;
+  tree.left[i] = std::min(i, j) == gamma ? n + gamma : gamma;
+  tree.right[i] = std::max(i, j) == gamma + 1 ? n + gamma + 1 : gamma + 1;
+}
+
+// Stable LSD radix sort of (code, primitive) pairs on the 30 bit code
+
+static void RadixSort(std::vector<uint32_t> &codes, std::vector<uint32_t> &ids) {
+  std::vector<uint32_t> codes_tmp(codes.size()), ids_tmp(ids.size());
+
+  for (int shift = 0; shift < 30; shift += 10) {
+    uint32_t offsets[1025] = {0};
+    for (uint32_t c : codes) offsets[((c >> shift) & 1023) + 1]++;
+    for (int b = 0; b < 1024; ++b) offsets[b + 1] += offsets[b];
+
+    for (size_t i = 0; i < codes.size(); ++i) {
+      uint32_t dst = offsets[(codes[i] >> shift) & 1023]++;
+      codes_tmp[dst] = codes[i];
+      ids_tmp[dst] = ids[i];
+    }
+    codes.swap(codes_tmp);
+    ids.swap(ids_tmp);
+  }
+}
+
+static void UpdateNode(RadixTree &tree, uint32_t k) {
+  uint32_t l = tree.left[k], r = tree.right[k];
+  tree.bounds[k] = tree.bounds[l];
+  tree.bounds[k].Grow(tree.bounds[r]);
+  tree.count[k] = tree.count[l] + tree.count[r];
+  tree.cost[k] = tree.bounds[k].Area() + tree.cost[l] + tree.cost[r];
+}
+
+// Karras and Aila 2013 - take the treelet of up to 7 leaves under k, find the cheapest
+// tree over those leaves by dynamic programming across their subsets, and rebuild the
+// treelet that way if it beats what is there
+
+static const int TREELET_LEAVES = 7;
+
+static void AssignTreelet(RadixTree &tree, uint32_t k, uint32_t set, const uint32_t *leaves, const uint32_t *best_split,
+  const uint32_t *pool, int &next_pool) {
+  uint32_t parts[2] = { best_split[set], set ^ best_split[set] };
+  uint32_t children[2];
+
+  for (int c = 0; c < 2; ++c) {
+    if ((parts[c] & (parts[c] - 1)) == 0) {
+      children[c] = leaves[__builtin_ctz(parts[c])];
+    } else {
+      children[c] = pool[next_pool++];
+      AssignTreelet(tree, children[c], parts[c], leaves, best_split, pool, next_pool);
+    }
+  }
+
+  tree.left[k] = children[0];
+  tree.right[k] = children[1];
+  UpdateNode(tree, k);
+}
+
+static void RestructureTreelet(RadixTree &tree, uint32_t k) {
+  uint32_t leaves[TREELET_LEAVES] = { tree.left[k], tree.right[k] };
+  uint32_t pool[TREELET_LEAVES];
+  int num_leaves = 2, num_pool = 0;
+
+  // Grow the treelet by opening up its largest internal leaf each time
+  while (num_leaves < TREELET_LEAVES) {
+    int largest = -1;
+    float largest_area = -1.0f;
+    for (int i = 0; i < num_leaves; ++i) {
+      if (!tree.IsLeaf(leaves[i]) && tree.bounds[leaves[i]].Area() > largest_area) {
+        largest_area = tree.bounds[leaves[i]].Area();
+        largest = i;
+      }
+    }
+    if (largest < 0) break;
+
+    uint32_t opened = leaves[largest];
+    pool[num_pool++] = opened;
+    leaves[largest] = tree.left[opened];
+    leaves[num_leaves++] = tree.right[opened];
+  }
+
+  if (num_leaves < 3) {
+    return;
+  }
+
+  // Subsets are only ever split into numerically smaller subsets, so a simple count
+  // up visits them in an order that works
+  const uint32_t num_sets = 1u << num_leaves;
+  BoundingBox set_bounds[1 << TREELET_LEAVES];
+  float best_cost[1 << TREELET_LEAVES];
+  uint32_t best_split[1 << TREELET_LEAVES];
+
+  for (uint32_t set = 1; set < num_sets; ++set) {
+    uint32_t low = set & (0u - set);
+    int leaf = __builtin_ctz(set);
+
+    if (set == low) {
+      set_bounds[set] = tree.bounds[leaves[leaf]];
+      best_cost[set] = tree.cost[leaves[leaf]];
+      continue;
+    }
+
+    set_bounds[set] = set_bounds[set ^ low];
+    set_bounds[set].Grow(tree.bounds[leaves[leaf]]);
+
+    // Each split once - the part holding the lowest leaf goes left
+    float best = MAX_DISTANCE;
+    for (uint32_t part = (set - 1) & set; part > 0; part = (part - 1) & set) {
+      if (!(part & low)) continue;
+      float cost = best_cost[part] + best_cost[set ^ part];
+      if (cost < best) {
+        best = cost;
+        best_split[set] = part;
+      }
+    }
+    best_cost[set] = set_bounds[set].Area() + best;
+  }
+
+  if (best_cost[num_sets - 1] >= tree.cost[k] * 0.999f) {
+    return;
+  }
+
+  int next_pool = 0;
+  AssignTreelet(tree, k, num_sets - 1, leaves, best_split, pool, next_pool);
+}
+
+// Fill bounds, counts and costs from the leaves up, restructuring on the way if asked.
+// Subtrees small enough to end up inside one of our leaves are not worth restructuring
+
+static void FinishRadixTree(RadixTree &tree, unsigned int leaf_size, bool treelets) {
+  std::vector< std::pair<uint32_t, bool> > stack;
+  stack.push_back(std::make_pair(0u, false));
+
+  while (!stack.empty()) {
+    std::pair<uint32_t, bool> top = stack.back();
+    stack.pop_back();
+    uint32_t k = top.first;
+
+    if (tree.IsLeaf(k)) continue;
+
+    if (!top.second) {
+      stack.push_back(std::make_pair(k, true));
+      stack.push_back(std::make_pair(tree.left[k], false));
+      stack.push_back(std::make_pair(tree.right[k], false));
+      continue;
+    }
+
+    UpdateNode(tree, k);
+    if (treelets && tree.count[k] > 2 * leaf_size) {
+      RestructureTreelet(tree, k);
+    }
+  }
+}
+
+void BvhBuilder::Gather(const RadixTree &tree, uint32_t k, uint32_t &next) {
+  if (tree.IsLeaf(k)) {
+    order[next++] = tree.prim[k - tree.num_internal];
+    return;
+  }
+  Gather(tree, tree.left[k], next);
+  Gather(tree, tree.right[k], next);
+}
+
+// Copy the radix tree into our node layout. Subtrees that fit in a leaf are gathered
+// into one, and anything still too deep is handed to the median splitter
+
+void BvhBuilder::Emit(const RadixTree &tree, uint32_t node, uint32_t k, uint32_t &next, unsigned int depth) {
+  if (tree.count[k] <= leaf_size || depth >= BVH_MEDIAN_DEPTH) {
+    uint32_t begin = next;
+    Gather(tree, k, next);
+    Split(node, begin, next, depth);
+    return;
+  }
+
+  uint32_t left = nodes.size();
+  nodes.resize(left + 2);
+  depths.resize(left + 2);
+  nodes[node].first = left;
+  nodes[node].count = 0;
+  depths[node] = depth;
+
+  Emit(tree, left, tree.left[k], next, depth + 1);
+  Emit(tree, left + 1, tree.right[k], next, depth + 1);
+}
+
+void Bvh::BuildLbvh(const std::vector<BoundingBox> &prims, const RaytraceOptions &options, bool treelets) {
+  const uint32_t n = prims.size();
+  const int chunk = 4096;
+  const int num_chunks = (n + chunk - 1) / chunk;
+
+  BvhBuilder builder(prims, nodes, leaf_size);
+  builder.centres.resize(n);
+  builder.order.resize(n);
+
+  BoundingBox centre_bounds;
+  for (uint32_t i = 0; i < n; ++i) {
+    builder.centres[i] = prims[i].Centre();
+    centre_bounds.Grow(builder.centres[i]);
+  }
+
+  nodes.resize(1);
+  builder.depths.resize(1);
+
+  if (n <= leaf_size) {
+    for (uint32_t i = 0; i < n; ++i) builder.order[i] = i;
+    builder.Split(0, 0, n, 0);
+    Finish(builder.order, builder.depths);
+    build_cost = Cost();
+    return;
+  }
+
+  glm::vec3 inv_extent = 1.0f / glm::max(centre_bounds.max - centre_bounds.min, glm::vec3(1e-6f));
+
+  std::vector<uint32_t> codes(n), ids(n);
+  {
+    WorkQueue chunks(num_chunks);
+    RunParallel(options, [&](unsigned int thread) {
+      int c;
+      while (chunks.Next(c)) {
+        uint32_t end = std::min(n, static_cast<uint32_t>(c + 1) * chunk);
+        for (uint32_t i = static_cast<uint32_t>(c) * chunk; i < end; ++i) {
+          codes[i] = Morton3D((builder.centres[i] - centre_bounds.min) * inv_extent);
+          ids[i] = i;
+        }
+      }
+    });
+  }
+
+  RadixSort(codes, ids);
+
+  std::vector<uint64_t> keys(n);
+  for (uint32_t i = 0; i < n; ++i) {
+    keys[i] = static_cast<uint64_t>(codes[i]) << 32 | i;
+  }
+
+  RadixTree tree;
+  tree.num_internal = n - 1;
+  tree.left.resize(n - 1);
+  tree.right.resize(n - 1);
+  tree.prim.swap(ids);
+  tree.bounds.resize(2 * n - 1);
+  tree.count.resize(2 * n - 1, 1);
+  tree.cost.resize(2 * n - 1);
+
+  for (uint32_t i = 0; i < n; ++i) {
+    tree.bounds[n - 1 + i] = prims[tree.prim[i]];
+    tree.cost[n - 1 + i] = prims[tree.prim[i]].Area();
+  }
+
+  {
+    WorkQueue chunks((n - 1 + chunk - 1) / chunk);
+    RunParallel(options, [&](unsigned int thread) {
+      int c;
+      while (chunks.Next(c)) {
+        uint32_t end = std::min(n - 1, static_cast<uint32_t>(c + 1) * chunk);
+        for (uint32_t i = static_cast<uint32_t>(c) * chunk; i < end; ++i) FindChildren(keys, i, tree);
+      }
+    });
+  }
+
+  FinishRadixTree(tree, leaf_size, treelets);
+
+  uint32_t next = 0;
+  builder.Emit(tree, 0, 0, next, 0);
+
+  // Only the leaves made by Split have bounds so far
+  Finish(builder.order, builder.depths);
+  Refit(prims, options);
+  build_cost = Cost();
+}
+
+// Spatial split BVH. Works on references - a triangle plus the part of its bounds
+// that the current node covers
+
+struct SbvhRef {
+  uint32_t prim;
+  BoundingBox box;
+};
+
+struct SbvhSplit {
+  SbvhSplit() : cost(MAX_DISTANCE), axis(-1), bin(0), spatial(false) {}
+  float cost;
+  int axis;
+  int bin;
+  bool spatial;
+  BoundingBox left, right;
+  float pos;
+};
+
+// Only try spatial splits where the object split children overlap by more than this
+// fraction of the root area
+static const float SBVH_ALPHA = 1e-5f;
+
+static inline bool ValidBox(const BoundingBox &b) {
+  return b.min.x <= b.max.x && b.min.y <= b.max.y && b.min.z <= b.max.z;
+}
+
+static inline BoundingBox Overlap(const BoundingBox &a, const BoundingBox &b) {
+  return BoundingBox(glm::max(a.min, b.min), glm::min(a.max, b.max));
+}
+
+struct SbvhBuilder {
+  const std::vector<Triangle> &tris;
+  BvhNodes &nodes;
+  std::vector<uint32_t> order;
+  std::vector<uint32_t> depths;
+  unsigned int leaf_size;
+  float min_overlap;
+  size_t num_refs, max_refs;
+
+  SbvhBuilder(const std::vector<Triangle> &t, BvhNodes &n, unsigned int ls) : tris(t), nodes(n), leaf_size(ls) {}
+
+  // Nodes still to split. Worked through breadth first, so the reference budget goes
+  // on the upper levels where spatial splits help most
+  struct Task {
+    uint32_t node;
+    unsigned int depth;
+    std::vector<SbvhRef> refs;
+  };
+  std::deque<Task> tasks;
+
+  void Split(Task &task);
+  void ObjectSplit(const std::vector<SbvhRef> &refs, SbvhSplit &split);
+  void SpatialSplit(const std::vector<SbvhRef> &refs, const BoundingBox &bounds, SbvhSplit &split);
+  BoundingBox Clip(const SbvhRef &ref, int axis, float lo, float hi) const;
+};
+
+// The bounds of the part of a triangle between two planes, within the reference box
+
+BoundingBox SbvhBuilder::Clip(const SbvhRef &ref, int axis, float lo, float hi) const {
+  const Triangle &t = tris[ref.prim];
+  const glm::vec3 *v[3] = { &t.v0, &t.v1, &t.v2 };
+  BoundingBox b;
+
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec3 &a = *v[i];
+    const glm::vec3 &c = *v[(i + 1) % 3];
+
+    if (a[axis] >= lo && a[axis] <= hi) b.Grow(a);
+
+    float planes[2] = { lo, hi };
+    for (int k = 0; k < 2; ++k) {
+      if ((a[axis] < planes[k]) != (c[axis] < planes[k])) {
+        glm::vec3 p = a + (c - a) * ((planes[k] - a[axis]) / (c[axis] - a[axis]));
+        p[axis] = planes[k];
+        b.Grow(p);
+      }
+    }
+  }
+
+  return Overlap(b, ref.box);
+}
+
+void SbvhBuilder::ObjectSplit(const std::vector<SbvhRef> &refs, SbvhSplit &split) {
+  BoundingBox centre_bounds;
+  for (const SbvhRef &r : refs) centre_bounds.Grow(r.box.Centre());
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = centre_bounds.min[axis];
+    float extent = centre_bounds.max[axis] - lo;
+    if (extent <= 0.0f) continue;
+
+    BoundingBox bins[BVH_BINS];
+    unsigned int counts[BVH_BINS] = {0};
+    float scale = BVH_BINS / extent;
+
+    for (const SbvhRef &r : refs) {
+      int b = std::min(BVH_BINS - 1, static_cast<int>((r.box.Centre()[axis] - lo) * scale));
+      bins[b].Grow(r.box);
+      counts[b]++;
+    }
+
+    BoundingBox rights[BVH_BINS];
+    unsigned int right_counts[BVH_BINS];
+    BoundingBox right;
+    unsigned int right_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      right.Grow(bins[b]);
+      right_count += counts[b];
+      rights[b] = right;
+      right_counts[b] = right_count;
+    }
+
+    BoundingBox left;
+    unsigned int left_count = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      left.Grow(bins[b]);
+      left_count += counts[b];
+      if (left_count == 0 || right_counts[b + 1] == 0) continue;
+      float cost = left.Area() * left_count + rights[b + 1].Area() * right_counts[b + 1];
+      if (cost < split.cost) {
+        split.cost = cost;
+        split.axis = axis;
+        split.bin = b;
+        split.spatial = false;
+        split.left = left;
+        split.right = rights[b + 1];
+        split.pos = lo + (b + 1) / scale;
+      }
+    }
+  }
+}
+
+// Bin the clipped references into slabs of the node bounds, counting where each one
+// starts and ends, then sweep for the cheapest plane
+
+void SbvhBuilder::SpatialSplit(const std::vector<SbvhRef> &refs, const BoundingBox &bounds, SbvhSplit &split) {
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = bounds.min[axis];
+    float extent = bounds.max[axis] - lo;
+    if (extent <= 0.0f) continue;
+
+    float width = extent / BVH_BINS;
+    BoundingBox bins[BVH_BINS];
+    unsigned int enter[BVH_BINS] = {0}, exit[BVH_BINS] = {0};
+
+    for (const SbvhRef &r : refs) {
+      int first = glm::clamp(static_cast<int>((r.box.min[axis] - lo) / width), 0, BVH_BINS - 1);
+      int last = glm::clamp(static_cast<int>((r.box.max[axis] - lo) / width), first, BVH_BINS - 1);
+
+      for (int b = first; b <= last; ++b) {
+        BoundingBox part = first == last ? r.box : Clip(r, axis, lo + b * width, lo + (b + 1) * width);
+        if (ValidBox(part)) bins[b].Grow(part);
+      }
+      enter[first]++;
+      exit[last]++;
+    }
+
+    BoundingBox rights[BVH_BINS];
+    unsigned int right_counts[BVH_BINS];
+    BoundingBox right;
+    unsigned int right_count = 0;
+    for (int b = BVH_BINS - 1; b > 0; --b) {
+      right.Grow(bins[b]);
+      right_count += exit[b];
+      rights[b] = right;
+      right_counts[b] = right_count;
+    }
+
+    BoundingBox left;
+    unsigned int left_count = 0;
+    for (int b = 0; b < BVH_BINS - 1; ++b) {
+      left.Grow(bins[b]);
+      left_count += enter[b];
+      if (left_count == 0 || right_counts[b + 1] == 0) continue;
+      float cost = left.Area() * left_count + rights[b + 1].Area() * right_counts[b + 1];
+      if (cost < split.cost) {
+        split.cost = cost;
+        split.axis = axis;
+        split.bin = b;
+        split.spatial = true;
+        split.left = left;
+        split.right = rights[b + 1];
+        split.pos = lo + (b + 1) * width;
+      }
+    }
+  }
+}
+
+void SbvhBuilder::Split(Task &task) {
+  uint32_t node = task.node;
+  unsigned int depth = task.depth;
+  std::vector<SbvhRef> &refs = task.refs;
+
+  BoundingBox bounds;
+  for (const SbvhRef &r : refs) bounds.Grow(r.box);
+
+  nodes[node].min = bounds.min;
+  nodes[node].max = bounds.max;
+  depths[node] = depth;
+
+  if (refs.size() <= leaf_size) {
+    nodes[node].first = order.size();
+    nodes[node].count = refs.size();
+    for (const SbvhRef &r : refs) order.push_back(r.prim);
+    return;
+  }
+
+  std::vector<SbvhRef> left_refs, right_refs;
+  SbvhSplit split;
+
+  if (depth < BVH_MEDIAN_DEPTH) {
+    ObjectSplit(refs, split);
+
+    // Spatial splits are only worth the extra references where the object split
+    // leaves the children overlapping
+    if (num_refs < max_refs) {
+      BoundingBox overlap = Overlap(split.left, split.right);
+      if (split.axis < 0 || (ValidBox(overlap) && overlap.Area() > min_overlap)) {
+        SpatialSplit(refs, bounds, split);
+      }
+    }
+  }
+
+  if (split.axis >= 0 && !split.spatial) {
+    float lo = split.pos;
+    for (const SbvhRef &r : refs) {
+      (r.box.Centre()[split.axis] < lo ? left_refs : right_refs).push_back(r);
+    }
+
+  } else if (split.axis >= 0) {
+    BoundingBox left = split.left, right = split.right;
+    float left_count = 0, right_count = 0;
+    for (const SbvhRef &r : refs) {
+      if (r.box.min[split.axis] < split.pos) left_count++;
+      if (r.box.max[split.axis] > split.pos) right_count++;
+    }
+
+    for (const SbvhRef &r : refs) {
+      if (r.box.max[split.axis] <= split.pos) {
+        left_refs.push_back(r);
+      } else if (r.box.min[split.axis] >= split.pos) {
+        right_refs.push_back(r);
+      } else {
+
+        // Crossing the plane - see if sending it whole to one side is cheaper than
+        // splitting it, and always do so once the budget is spent
+        BoundingBox whole_left = left, whole_right = right;
+        whole_left.Grow(r.box);
+        whole_right.Grow(r.box);
+        float cost_split = left.Area() * left_count + right.Area() * right_count;
+        float cost_left = whole_left.Area() * left_count + right.Area() * (right_count - 1);
+        float cost_right = left.Area() * (left_count - 1) + whole_right.Area() * right_count;
+
+        BoundingBox left_part = Clip(r, split.axis, r.box.min[split.axis], split.pos);
+        BoundingBox right_part = Clip(r, split.axis, split.pos, r.box.max[split.axis]);
+        bool can_split = num_refs < max_refs && ValidBox(left_part) && ValidBox(right_part);
+
+        if (can_split && cost_split < cost_left && cost_split < cost_right) {
+          SbvhRef lr = { r.prim, left_part };
+          SbvhRef rr = { r.prim, right_part };
+          left_refs.push_back(lr);
+          right_refs.push_back(rr);
+          num_refs++;
+        } else if (cost_left <= cost_right) {
+          left_refs.push_back(r);
+          left = whole_left;
+          right_count--;
+        } else {
+          right_refs.push_back(r);
+          right = whole_right;
+          left_count--;
+        }
+      }
+    }
+  }
+
+  // Nothing separated them - split at the median of the longest axis
+  if (left_refs.empty() || right_refs.empty()) {
+    left_refs.clear();
+    right_refs.clear();
+    glm::vec3 extent = bounds.max - bounds.min;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    size_t mid = refs.size() / 2;
+    std::nth_element(refs.begin(), refs.begin() + mid, refs.end(), [axis](const SbvhRef &a, const SbvhRef &b) {
+      return a.box.Centre()[axis] < b.box.Centre()[axis];
+    });
+    left_refs.assign(refs.begin(), refs.begin() + mid);
+    right_refs.assign(refs.begin() + mid, refs.end());
+  }
+
+  std::vector<SbvhRef>().swap(refs);
+
+  uint32_t left = nodes.size();
+  nodes.resize(left + 2);
+  depths.resize(left + 2);
+  nodes[node].first = left;
+  nodes[node].count = 0;
+
+  tasks.push_back(Task());
+  tasks.back().node = left;
+  tasks.back().depth = depth + 1;
+  tasks.back().refs.swap(left_refs);
+
+  tasks.push_back(Task());
+  tasks.back().node = left + 1;
+  tasks.back().depth = depth + 1;
+  tasks.back().refs.swap(right_refs);
+}
+
+void Bvh::BuildSpatial(const std::vector<Triangle> &triangles, unsigned int size, const RaytraceOptions &options) {
+  nodes.clear();
+  indices.clear();
+  levels.clear();
+  leaf_size = size > 0 ? size : 1;
+
+  if (triangles.empty()) {
+    return;
+  }
+
+  SbvhBuilder builder(triangles, nodes, leaf_size);
+  std::vector<SbvhRef> refs(triangles.size());
+  BoundingBox root;
+
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    refs[i].prim = i;
+    refs[i].box.Grow(triangles[i].v0);
+    refs[i].box.Grow(triangles[i].v1);
+    refs[i].box.Grow(triangles[i].v2);
+    root.Grow(refs[i].box);
+  }
+
+  builder.min_overlap = SBVH_ALPHA * root.Area();
+  builder.num_refs = triangles.size();
+  builder.max_refs = triangles.size() + static_cast<size_t>(triangles.size() * SBVH_BUDGET);
+
+  nodes.resize(1);
+  builder.depths.resize(1);
+
+  builder.tasks.push_back(SbvhBuilder::Task());
+  builder.tasks.back().node = 0;
+  builder.tasks.back().depth = 0;
+  builder.tasks.back().refs.swap(refs);
+
+  while (!builder.tasks.empty()) {
+    SbvhBuilder::Task task;
+    task.node = builder.tasks.front().node;
+    task.depth = builder.tasks.front().depth;
+    task.refs.swap(builder.tasks.front().refs);
+    builder.tasks.pop_front();
+    builder.Split(task);
+  }
+
+  Finish(builder.order, builder.depths);
+  build_cost = Cost();
+
+  if (options.bvh_layout != "depth-first") {
+    Cluster();
+  }
+}
+
+// Blocks are handed out in the order they are started, so the blocks near the top of
+// the tree are near each other too. Each block is sized to finish on a page boundary
+
+void Bvh::Cluster() {
+  if (nodes.size() <= 1) {
+    return;
+  }
+
+  BvhNodes clustered;
+  clustered.reserve(nodes.size() + 1);
+  std::vector<uint32_t> moved(nodes.size());
+
+  BvhNode dummy;
+  dummy.min = glm::vec3(MAX_DISTANCE);
+  dummy.max = glm::vec3(-MAX_DISTANCE);
+  dummy.first = 0;
+  dummy.count = 0;
+
+  clustered.push_back(nodes[0]);
+  clustered.push_back(dummy);
+  moved[0] = 0;
+
+  // Pairs are named by the index of their first node, and ranked by the area of
+  // their parent
+  typedef std::pair<float, uint32_t> RankedPair;
+  std::deque<uint32_t> blocks;
+  if (!nodes[0].IsLeaf()) {
+    blocks.push_back(nodes[0].first);
+  }
+
+  std::priority_queue<RankedPair> frontier;
+  std::vector<char> chosen(nodes.size(), 0);
+  std::vector<uint32_t> stack;
+
+  while (!blocks.empty()) {
+    uint32_t top = blocks.front();
+    blocks.pop_front();
+
+    // Pick the pairs most likely to be visited ...
+    frontier.push(RankedPair(0.0f, top));
+    size_t room = BVH_BLOCK_PAIRS - (clustered.size() / 2) % BVH_BLOCK_PAIRS;
+    for (size_t placed = 0; placed < room && !frontier.empty(); ++placed) {
+      uint32_t pair = frontier.top().second;
+      frontier.pop();
+      chosen[pair] = 1;
+
+      for (uint32_t c = 0; c < 2; ++c) {
+        const BvhNode &child = nodes[pair + c];
+        if (!child.IsLeaf()) {
+          frontier.push(RankedPair(BoundingBox(child.min, child.max).Area(), child.first));
+        }
+      }
+    }
+
+    while (!frontier.empty()) {
+      blocks.push_back(frontier.top().second);
+      frontier.pop();
+    }
+
+    // ... then lay them out depth first, so that going down the left keeps reading
+    // the next cache line, which the hardware will often have fetched already
+    stack.push_back(top);
+    while (!stack.empty()) {
+      uint32_t pair = stack.back();
+      stack.pop_back();
+
+      for (uint32_t c = 0; c < 2; ++c) {
+        moved[pair + c] = clustered.size();
+        clustered.push_back(nodes[pair + c]);
+      }
+      for (int c = 1; c >= 0; --c) {
+        const BvhNode &child = nodes[pair + c];
+        if (!child.IsLeaf() && chosen[child.first]) stack.push_back(child.first);
+      }
+    }
+  }
+
+  for (BvhNode &node : clustered) {
+    if (!node.IsLeaf()) node.first = moved[node.first];
+  }
+
+  for (std::vector<uint32_t> &level : levels) {
+    for (uint32_t &n : level) n = moved[n];
+  }
+
+  nodes.swap(clustered);
+}
+
+size_t Bvh::References() const {
+  size_t refs = 0;
+  for (uint32_t i : indices) {
+    if (i != BVH_PADDING) refs++;
+  }
+  return refs;
+}
+
+void Bvh::Refit(const std::vector<BoundingBox> &prims, const RaytraceOptions &options) {
+
+  // Children are always one level deeper, so they are done before their parent
+  auto refit_node = [&](uint32_t n) {
+    BvhNode &node = nodes[n];
+    BoundingBox bounds;
+
+    if (node.IsLeaf()) {
+      for (uint32_t i = node.first; i < node.first + node.count; ++i) {
+        if (indices[i] != BVH_PADDING) bounds.Grow(prims[indices[i]]);
+      }
+    } else {
+      bounds.Grow(BoundingBox(nodes[node.first].min, nodes[node.first].max));
+      bounds.Grow(BoundingBox(nodes[node.first + 1].min, nodes[node.first + 1].max));
+    }
+
+    node.min = bounds.min;
+    node.max = bounds.max;
+  };
+
+  for (size_t d = levels.size(); d-- > 0; ) {
+    const std::vector<uint32_t> &level = levels[d];
+
+    if (level.size() < BVH_PARALLEL_LEVEL) {
+      for (uint32_t n : level) refit_node(n);
+      continue;
+    }
+
+    const int chunk = 256;
+    WorkQueue chunks((level.size() + chunk - 1) / chunk);
+    RunParallel(options, [&](unsigned int thread) {
+      int c;
+      while (chunks.Next(c)) {
+        size_t end = std::min(level.size(), static_cast<size_t>(c + 1) * chunk);
+        for (size_t i = static_cast<size_t>(c) * chunk; i < end; ++i) refit_node(level[i]);
+      }
+    });
+  }
+}
+
+// Expected cost of a random ray that hits the root, counting a box test and a leaf
+// batch as one unit each
+
+float Bvh::Cost() const {
+  if (nodes.empty()) {
+    return 0.0f;
+  }
+
+  float root_area = BoundingBox(nodes[0].min, nodes[0].max).Area();
+  if (root_area <= 0.0f) {
+    return 0.0f;
+  }
+
+  float cost = 0.0f;
+  for (const BvhNode &node : nodes) {
+    cost += BoundingBox(node.min, node.max).Area();
+  }
+
+  return cost / root_area;
+}
+
+// Compression - walk the tree depth first, quantising both children of each node
+// against the node's own decoded box
+
+void CompressedBvh::Build(const Bvh &bvh) {
+  nodes.clear();
+  bounds = BoundingBox();
+  root = 0;
+  leaf_size = bvh.leaf_size;
+
+  if (bvh.Empty()) {
+    return;
+  }
+
+  bounds = BoundingBox(bvh.nodes[0].min, bvh.nodes[0].max);
+  if (bvh.nodes[0].IsLeaf()) {
+    root = COMPRESSED_LEAF | bvh.nodes[0].first;
+    return;
+  }
+
+  nodes.reserve(bvh.nodes.size() / 2);
+  root = Emit(bvh, 0, bounds);
+}
+
+uint32_t CompressedBvh::Emit(const Bvh &bvh, uint32_t n, const BoundingBox &frame) {
+  uint32_t index = nodes.size();
+  nodes.push_back(CompressedBvhNode());
+
+  const BvhNode &node = bvh.nodes[n];
+  glm::vec3 step = QuantisedStep(frame);
+  glm::vec3 inv_step = 1.0f / glm::max(step, glm::vec3(FLT_MIN));
+  BoundingBox child_frame[2];
+
+  for (int c = 0; c < 2; ++c) {
+    const BvhNode &child = bvh.nodes[node.first + c];
+    CompressedBvhNode &q = nodes[index];
+
+    // Round down and up, then step out further if float rounding left the decoded
+    // box short of the real one
+    for (int a = 0; a < 3; ++a) {
+      int lo = glm::clamp(static_cast<int>(std::floor((child.min[a] - frame.min[a]) * inv_step[a])), 0, 255);
+      int hi = glm::clamp(static_cast<int>(std::ceil((child.max[a] - frame.min[a]) * inv_step[a])), 0, 255);
+      while (lo > 0 && frame.min[a] + lo * step[a] > child.min[a]) lo--;
+      while (hi < 255 && frame.min[a] + hi * step[a] < child.max[a]) hi++;
+      q.lo[c][a] = lo;
+      q.hi[c][a] = hi;
+    }
+    child_frame[c] = QuantisedChild(q, c, frame, step);
+  }
+
+  for (int c = 0; c < 2; ++c) {
+    const BvhNode &child = bvh.nodes[node.first + c];
+    uint32_t ref = child.IsLeaf() ? (COMPRESSED_LEAF | child.first) : Emit(bvh, node.first + c, child_frame[c]);
+    nodes[index].child[c] = ref;
+  }
+
+  return index;
+}
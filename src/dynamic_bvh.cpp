@@ -0,0 +1,273 @@
+/**
+* @brief Bounding volume hierarchy kept up to date one primitive at a time
+* @file dynamic_bvh.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "dynamic_bvh.hpp"
+
+#include <algorithm>
+#include <queue>
+#include <random>
+
+using namespace std;
+
+static BoundingBox Union(const BoundingBox &a, const BoundingBox &b) {
+  BoundingBox u = a;
+  u.Grow(b);
+  return u;
+}
+
+static bool Contains(const BoundingBox &outer, const BoundingBox &inner) {
+  return glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max));
+}
+
+uint32_t DynamicBvh::Allocate() {
+  if (free_list == DBVH_NULL) {
+    nodes.push_back(DynamicBvhNode());
+    return nodes.size() - 1;
+  }
+  uint32_t node = free_list;
+  free_list = nodes[node].parent;
+  return node;
+}
+
+void DynamicBvh::Free(uint32_t node) {
+  nodes[node].parent = free_list;
+  nodes[node].child[0] = DBVH_NULL;
+  nodes[node].child[1] = DBVH_NULL;
+  nodes[node].item = DBVH_NULL;
+  free_list = node;
+}
+
+void DynamicBvh::Clear() {
+  nodes.clear();
+  root = DBVH_NULL;
+  free_list = DBVH_NULL;
+  leaves = 0;
+}
+
+uint32_t DynamicBvh::Insert(const BoundingBox &box, uint32_t item) {
+  glm::vec3 margin = (box.max - box.min) * DBVH_MARGIN;
+
+  uint32_t leaf = Allocate();
+  nodes[leaf].box = BoundingBox(box.min - margin, box.max + margin);
+  nodes[leaf].child[0] = DBVH_NULL;
+  nodes[leaf].child[1] = DBVH_NULL;
+  nodes[leaf].item = item;
+  nodes[leaf].height = 0;
+
+  InsertLeaf(leaf);
+  leaves++;
+
+  if (Height() > DBVH_MAX_HEIGHT - 8) {
+    Rebalance();
+  }
+  return leaf;
+}
+
+void DynamicBvh::Remove(uint32_t leaf) {
+  RemoveLeaf(leaf);
+  Free(leaf);
+  leaves--;
+}
+
+bool DynamicBvh::Update(uint32_t leaf, const BoundingBox &box) {
+  if (Contains(nodes[leaf].box, box)) {
+    return false;
+  }
+
+  glm::vec3 margin = (box.max - box.min) * DBVH_MARGIN;
+  RemoveLeaf(leaf);
+  nodes[leaf].box = BoundingBox(box.min - margin, box.max + margin);
+  InsertLeaf(leaf);
+
+  if (Height() > DBVH_MAX_HEIGHT - 8) {
+    Rebalance();
+  }
+  return true;
+}
+
+// Cost of putting the new box next to a node is the area of the new parent, plus the
+// growth of every node above. That growth only adds up going down, so a subtree can
+// be skipped once even the new box alone would cost more than the best so far
+
+uint32_t DynamicBvh::FindSibling(const BoundingBox &box) const {
+  typedef std::pair<float, uint32_t> Candidate;   // Growth of the nodes above, node
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > queue;
+
+  float box_area = box.Area();
+  uint32_t best = root;
+  float best_cost = Union(box, nodes[root].box).Area();
+  queue.push(Candidate(0.0f, root));
+
+  while (!queue.empty()) {
+    float inherited = queue.top().first;
+    uint32_t node = queue.top().second;
+    queue.pop();
+
+    if (box_area + inherited >= best_cost) {
+      break;
+    }
+
+    float direct = Union(box, nodes[node].box).Area();
+    float cost = direct + inherited;
+    if (cost < best_cost) {
+      best_cost = cost;
+      best = node;
+    }
+
+    if (!nodes[node].IsLeaf()) {
+      float below = inherited + direct - nodes[node].box.Area();
+      if (box_area + below < best_cost) {
+        queue.push(Candidate(below, nodes[node].child[0]));
+        queue.push(Candidate(below, nodes[node].child[1]));
+      }
+    }
+  }
+
+  return best;
+}
+
+void DynamicBvh::InsertLeaf(uint32_t leaf) {
+  if (root == DBVH_NULL) {
+    root = leaf;
+    nodes[leaf].parent = DBVH_NULL;
+    return;
+  }
+
+  uint32_t sibling = FindSibling(nodes[leaf].box);
+  uint32_t old_parent = nodes[sibling].parent;
+  uint32_t parent = Allocate();
+
+  nodes[parent].parent = old_parent;
+  nodes[parent].child[0] = sibling;
+  nodes[parent].child[1] = leaf;
+  nodes[parent].item = DBVH_NULL;
+  nodes[parent].box = Union(nodes[sibling].box, nodes[leaf].box);
+  nodes[parent].height = nodes[sibling].height + 1;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+
+  if (old_parent == DBVH_NULL) {
+    root = parent;
+  } else {
+    DynamicBvhNode &p = nodes[old_parent];
+    p.child[p.child[0] == sibling ? 0 : 1] = parent;
+  }
+
+  Refit(parent);
+}
+
+// The leaf's sibling takes its parent's place, and the parent node is freed
+
+void DynamicBvh::RemoveLeaf(uint32_t leaf) {
+  if (leaf == root) {
+    root = DBVH_NULL;
+    return;
+  }
+
+  uint32_t parent = nodes[leaf].parent;
+  uint32_t grandparent = nodes[parent].parent;
+  uint32_t sibling = nodes[parent].child[nodes[parent].child[0] == leaf ? 1 : 0];
+
+  nodes[sibling].parent = grandparent;
+  if (grandparent == DBVH_NULL) {
+    root = sibling;
+  } else {
+    DynamicBvhNode &g = nodes[grandparent];
+    g.child[g.child[0] == parent ? 0 : 1] = sibling;
+    Refit(grandparent);
+  }
+
+  Free(parent);
+}
+
+void DynamicBvh::Refit(uint32_t node) {
+  while (node != DBVH_NULL) {
+    DynamicBvhNode &n = nodes[node];
+    n.box = Union(nodes[n.child[0]].box, nodes[n.child[1]].box);
+    Rotate(node);
+    n.height = 1 + std::max(nodes[n.child[0]].height, nodes[n.child[1]].height);
+    node = n.parent;
+  }
+}
+
+// Swapping child x with a grandchild z under the other child y leaves the node's own
+// box alone and only changes y's. Take whichever of the four swaps shrinks y the most
+
+void DynamicBvh::Rotate(uint32_t node) {
+  DynamicBvhNode &n = nodes[node];
+  float best_gain = 0.0f;
+  int best_x = -1, best_z = -1;
+
+  for (int x = 0; x < 2; ++x) {
+    const DynamicBvhNode &y = nodes[n.child[1 - x]];
+    if (y.IsLeaf()) continue;
+
+    for (int z = 0; z < 2; ++z) {
+      float gain = y.box.Area() - Union(nodes[n.child[x]].box, nodes[y.child[1 - z]].box).Area();
+      if (gain > best_gain) {
+        best_gain = gain;
+        best_x = x;
+        best_z = z;
+      }
+    }
+  }
+
+  if (best_x < 0) {
+    return;
+  }
+
+  uint32_t x = n.child[best_x];
+  uint32_t y = n.child[1 - best_x];
+  uint32_t z = nodes[y].child[best_z];
+
+  n.child[best_x] = z;
+  nodes[z].parent = node;
+  nodes[y].child[best_z] = x;
+  nodes[x].parent = y;
+
+  DynamicBvhNode &ny = nodes[y];
+  ny.box = Union(nodes[ny.child[0]].box, nodes[ny.child[1]].box);
+  ny.height = 1 + std::max(nodes[ny.child[0]].height, nodes[ny.child[1]].height);
+}
+
+// Only reached if edits have come in a pathological order - reinserting in a random
+// order gives a tree of about log n height
+
+void DynamicBvh::Rebalance() {
+  std::vector<uint32_t> all;
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    if (nodes[i].IsLeaf() && nodes[i].item != DBVH_NULL) all.push_back(i);
+  }
+
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    if (!nodes[i].IsLeaf()) Free(i);
+  }
+  root = DBVH_NULL;
+
+  std::mt19937 rng(static_cast<uint32_t>(all.size()));
+  std::shuffle(all.begin(), all.end(), rng);
+  for (uint32_t leaf : all) InsertLeaf(leaf);
+}
+
+float DynamicBvh::Cost() const {
+  if (root == DBVH_NULL) {
+    return 0.0f;
+  }
+
+  float root_area = nodes[root].box.Area();
+  if (root_area <= 0.0f) {
+    return 0.0f;
+  }
+
+  // Free nodes are always marked as leaves with no item
+  float cost = 0.0f;
+  for (const DynamicBvhNode &node : nodes) {
+    if (!node.IsLeaf() || node.item != DBVH_NULL) cost += node.box.Area();
+  }
+  return cost / root_area;
+}
@@ -0,0 +1,251 @@
+/**
+* @brief HDR environment maps, lighting the scene from every direction
+* @file environment.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "environment.hpp"
+#include "math_utils.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace std;
+
+static inline float Luminance(const glm::vec3 &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+bool Environment::Load(const std::string &filename, float scale) {
+  std::string extension = filename.substr(filename.rfind('.') + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+  bool found = extension == "pfm" ? LoadPfm(filename) : LoadHdr(filename);
+  if (!found || width <= 0 || height <= 0) {
+    return false;
+  }
+
+  for (glm::vec3 &t : texels) {
+    t *= scale;
+  }
+
+  BuildTable();
+  return true;
+}
+
+// Portable float map - a text header, then raw floats a row at a time from the bottom.
+// A negative scale means they are little endian
+
+bool Environment::LoadPfm(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary);
+  std::string type;
+  float endian;
+  in >> type >> width >> height >> endian;
+  in.get();
+
+  int channels = type == "PF" ? 3 : (type == "Pf" ? 1 : 0);
+  if (!in.good() || channels == 0 || width <= 0 || height <= 0) {
+    return false;
+  }
+
+  std::vector<float> row(width * channels);
+  texels.assign(width * height, glm::vec3(0.0f));
+  uint16_t probe = 1;
+  bool swap = (endian < 0.0f) != (*reinterpret_cast<uint8_t*>(&probe) == 1);
+
+  for (int y = height - 1; y >= 0; --y) {
+    if (!in.read(reinterpret_cast<char*>(row.data()), row.size() * sizeof(float))) {
+      return false;
+    }
+
+    for (int x = 0; x < width; ++x) {
+      float v[3];
+      for (int c = 0; c < channels; ++c) {
+        uint32_t bits;
+        memcpy(&bits, &row[x * channels + c], sizeof(bits));
+        if (swap) bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+        memcpy(&v[c], &bits, sizeof(bits));
+      }
+      texels[y * width + x] = channels == 3 ? glm::vec3(v[0], v[1], v[2]) : glm::vec3(v[0]);
+    }
+  }
+
+  return true;
+}
+
+// Radiance RGBE - a shared exponent per pixel, each scanline usually run length
+// encoded a channel at a time. Only the usual -Y H +X W layout is read, and the old
+// style of run length encoding is not
+
+bool Environment::LoadHdr(const std::string &filename) {
+  std::ifstream in(filename, std::ios::binary);
+  std::string line;
+
+  if (!std::getline(in, line) || line.compare(0, 2, "#?") != 0) {
+    return false;
+  }
+  while (std::getline(in, line) && !line.empty()) {}
+
+  char ya[3], xa[3];
+  if (!std::getline(in, line) || sscanf(line.c_str(), "%2s %d %2s %d", ya, &height, xa, &width) != 4 ||
+      strcmp(ya, "-Y") != 0 || strcmp(xa, "+X") != 0 || width <= 0 || height <= 0) {
+    return false;
+  }
+
+  std::vector<uint8_t> rgbe(width * 4);
+  texels.assign(width * height, glm::vec3(0.0f));
+
+  for (int y = 0; y < height; ++y) {
+    uint8_t start[4];
+    if (!in.read(reinterpret_cast<char*>(start), 4)) {
+      return false;
+    }
+
+    if (width >= 8 && width < 32768 && start[0] == 2 && start[1] == 2 && !(start[2] & 0x80)) {
+      if (((start[2] << 8) | start[3]) != width) {
+        return false;
+      }
+
+      for (int c = 0; c < 4; ++c) {
+        for (int x = 0; x < width; ) {
+          int count = in.get();
+          if (count == EOF) {
+            return false;
+          }
+
+          if (count > 128) {
+            count -= 128;
+            int value = in.get();
+            if (value == EOF || x + count > width) return false;
+            for (int k = 0; k < count; ++k) rgbe[(x++) * 4 + c] = value;
+          } else {
+            if (count == 0 || x + count > width) return false;
+            for (int k = 0; k < count; ++k) rgbe[(x++) * 4 + c] = in.get();
+          }
+        }
+      }
+    } else {
+      memcpy(rgbe.data(), start, 4);
+      if (!in.read(reinterpret_cast<char*>(rgbe.data() + 4), (width - 1) * 4)) {
+        return false;
+      }
+    }
+
+    for (int x = 0; x < width; ++x) {
+      const uint8_t *p = &rgbe[x * 4];
+      if (p[3] != 0) {
+        float f = ldexp(1.0f, static_cast<int>(p[3]) - (128 + 8));
+        texels[y * width + x] = glm::vec3(p[0], p[1], p[2]) * f;
+      }
+    }
+  }
+
+  return in.good() || in.eof();
+}
+
+// Each texel is weighted by its luminance and the sine of its row's angle from
+// straight up, as rows near the poles cover less of the sphere. Then slots with more
+// than the mean weight are used to fill up those with less, one each, so every slot
+// ends up holding at most two texels
+
+void Environment::BuildTable() {
+  size_t n = texels.size();
+  std::vector<double> weight(n);
+  double total = 0.0;
+
+  for (int y = 0; y < height; ++y) {
+    double sin_theta = sin(PI * (y + 0.5) / height);
+    for (int x = 0; x < width; ++x) {
+      size_t i = y * width + x;
+      weight[i] = std::max(Luminance(texels[i]), 0.0f) * sin_theta;
+      total += weight[i];
+    }
+  }
+
+  prob.assign(n, 1.0f);
+  alias.resize(n);
+  texel_pdf.assign(n, 0.0f);
+  for (size_t i = 0; i < n; ++i) alias[i] = i;
+
+  // A black map is never sampled from, so leave the table uniform
+  if (total <= 0.0) {
+    return;
+  }
+
+  std::vector<double> scaled(n);
+  std::vector<uint32_t> small, large;
+  for (size_t i = 0; i < n; ++i) {
+    texel_pdf[i] = weight[i] / total;
+    scaled[i] = weight[i] / total * n;
+    (scaled[i] < 1.0 ? small : large).push_back(i);
+  }
+
+  while (!small.empty() && !large.empty()) {
+    uint32_t s = small.back();
+    uint32_t l = large.back();
+    small.pop_back();
+    prob[s] = scaled[s];
+    alias[s] = l;
+
+    scaled[l] -= 1.0 - scaled[s];
+    if (scaled[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+
+  // Whatever is left is within rounding of a full slot
+  for (uint32_t i : small) prob[i] = 1.0f;
+  for (uint32_t i : large) prob[i] = 1.0f;
+}
+
+uint32_t Environment::Texel(const glm::vec3 &direction, float &sin_theta) const {
+  float cos_theta = std::max(-1.0f, std::min(1.0f, direction.y));
+  float phi = atan2(direction.z, direction.x);
+  sin_theta = sqrt(1.0f - cos_theta * cos_theta);
+
+  int x = static_cast<int>((phi / (2.0f * PI) + 0.5f) * width);
+  int y = static_cast<int>(acos(cos_theta) / PI * height);
+  x = std::max(0, std::min(width - 1, x));
+  y = std::max(0, std::min(height - 1, y));
+  return y * width + x;
+}
+
+glm::vec3 Environment::Lookup(const glm::vec3 &direction) const {
+  float sin_theta;
+  return texels[Texel(direction, sin_theta)];
+}
+
+// u1 picks the slot and u2 flips its coin, then is stretched back over [0,1) to place
+// the direction across the texel, with u3 placing it down it
+
+glm::vec3 Environment::Sample(float u1, float u2, float u3, float &pdf) const {
+  size_t n = texels.size();
+  size_t slot = std::min(static_cast<size_t>(u1 * n), n - 1);
+  uint32_t i;
+  if (u2 < prob[slot]) {
+    i = slot;
+    u2 /= prob[slot];
+  } else {
+    i = alias[slot];
+    u2 = (u2 - prob[slot]) / (1.0f - prob[slot]);
+  }
+  u2 = std::min(u2, 0.99999994f);
+
+  float theta = PI * ((i / width) + u3) / height;
+  float phi = 2.0f * PI * ((i % width + u2) / width - 0.5f);
+  float sin_theta = sin(theta);
+
+  // Uniform over the texel's rectangle in phi and theta, which is sin theta times
+  // bigger as a solid angle
+  pdf = sin_theta > 0.0f ? texel_pdf[i] * n / (2.0f * PI * PI * sin_theta) : 0.0f;
+  return glm::vec3(sin_theta * cos(phi), cos(theta), sin_theta * sin(phi));
+}
+
+float Environment::Pdf(const glm::vec3 &direction) const {
+  float sin_theta;
+  uint32_t i = Texel(direction, sin_theta);
+  return sin_theta > 0.0f ? texel_pdf[i] * texels.size() / (2.0f * PI * PI * sin_theta) : 0.0f;
+}
@@ -3,47 +3,73 @@
 #include "main.hpp"
 
 // SphereRayIntersection Test
+// Only the distance is found here. Anything behind the origin or beyond tmax is
+// rejected before the square root - the location and normal are left until we
+// know this sphere is the closest hit
 
-bool SphereRayIntersection(const Ray &ray, RayHit &hit, float radius, glm::vec3 centre) {
-  float l = glm::dot(ray.direction, (ray.origin - centre));
-  float p = pow(l, 2) - pow(glm::distance(ray.origin, centre),2) + pow(radius,2);
+bool SphereRayIntersection(const Ray &ray, float tmax, float &dist, float radius, const glm::vec3 &centre) {
+  glm::vec3 oc = ray.origin - centre;
+  float l = glm::dot(ray.direction, oc);
 
-  if (p < 0){
+  // Centre is behind us, so the near side is too (we ignore hits from inside)
+  if (l > 0) {
     return false;
   }
 
-  p = sqrt(p);
+  float p = l * l - glm::dot(oc, oc) + radius * radius;
 
-  float dist0 = -l - p;
-  float dist1 = -l + p;
+  if (p <= 0){
+    return false;
+  }
 
-  if (abs(dist0 - dist1) < EPSILON){
+  // Near side lies beyond tmax - that is -l - sqrt(p) >= tmax, tested without the root
+  float m = -l - tmax;
+  if (m >= 0 && m * m >= p){
     return false;
   }
 
-  if( dist1 > 0) hit.dist = dist1;
-  if (dist0 < dist1 && dist0 > 0) hit.dist = dist0;
-  else return false;
+  float dist0 = -l - sqrt(p);
 
-  hit.loc = ray.direction * hit.dist + ray.origin;
-  hit.normal = glm::normalize( hit.loc - centre);
+  if (dist0 <= 0 || dist0 >= tmax){
+    return false;
+  }
 
+  dist = dist0;
   return true;
- 
 }
 
-
 // TODO - There seems to be an issue with spheres under 1.0 radius :S
 
-bool Sphere::RayIntersection(const Ray &ray, RayHit &hit){
-  return SphereRayIntersection(ray,hit,radius,centre); 
+bool Sphere::Intersect(const Ray &ray, float tmax, float &dist) const {
+  return SphereRayIntersection(ray,tmax,dist,radius,centre); 
+}
+
+glm::vec3 Sphere::Normal(const glm::vec3 &loc) const {
+  return (loc - centre) / radius;
+}
+
+float Sphere::Exit(const Ray &ray) const {
+  glm::vec3 oc = ray.origin - centre;
+  float l = glm::dot(ray.direction, oc);
+  float p = l * l - glm::dot(oc, oc) + radius * radius;
+  return -l + sqrt(std::max(p, 0.0f));
 }
 
-bool Light::RayIntersection(const Ray &ray, RayHit &hit) {
-  return SphereRayIntersection(ray,hit,radius,pos); 
+bool Light::Intersect(const Ray &ray, float tmax, float &dist) const {
+  return SphereRayIntersection(ray,tmax,dist,radius,pos); 
 }
 
-bool Ground::RayIntersection(const Ray &ray, RayHit &hit) {
+bool Sphere::Occludes(const Ray &ray, float tmax) const {
+  float dist;
+  return Intersect(ray,tmax,dist);
+}
+
+bool Light::Occludes(const Ray &ray, float tmax) const {
+  float dist;
+  return Intersect(ray,tmax,dist);
+}
+
+bool Ground::Intersect(const Ray &ray, float tmax, float &dist) const {
   
   if ( ray.direction.y >= 0.0f && height <= 0.0f)
     return false;
@@ -51,17 +77,18 @@ bool Ground::RayIntersection(const Ray &ray, RayHit &hit) {
   if ( ray.direction.y < 0.0f && height > 0.0f)
     return false;
 
-  hit.dist =  static_cast<float>(fabs(static_cast<float>(fabs(ray.origin.y - height)) / ray.direction.y));
-  
-  hit.normal.x = 0.0f;
-  hit.normal.y = 1.0f;
-  hit.normal.z = 0.0f;
-  glm::normalize(hit.normal);
+  float height_above = fabs(ray.origin.y - height);
 
-  hit.loc = ray.direction * hit.dist + ray.origin;
-  
+  if (height_above >= tmax * fabs(ray.direction.y))
+    return false;
+
+  dist = height_above / fabs(ray.direction.y);
   return true;
+}
 
+bool Ground::Occludes(const Ray &ray, float tmax) const {
+  float dist;
+  return Intersect(ray,tmax,dist);
 }
 
 bool TestTriangle(const Triangle &triangle, const Ray &ray, float &distance ) {
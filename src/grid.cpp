@@ -0,0 +1,116 @@
+/**
+* @brief Uniform grid over boxes, walked with a 3D-DDA
+* @file grid.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Primitives per cell we aim for
+static const float GRID_DENSITY = 2.0f;
+
+// Cells per axis at most, and in total
+static const int GRID_MAX_RES = 512;
+static const size_t GRID_MAX_CELLS = 1 << 24;
+
+// Cells for the uniformity check hold this many centres on average. With random
+// points about e^-4, or 2%, of them would be empty
+static const float GRID_CHECK_DENSITY = 4.0f;
+static const float GRID_MAX_EMPTY = 0.1f;
+
+// Cells per axis for n primitives over the bounds, at the given density
+
+static glm::ivec3 GridResolution(const BoundingBox &bounds, size_t n, float density) {
+  glm::vec3 extent = glm::max(bounds.max - bounds.min, glm::vec3(EPSILON));
+  float volume = extent.x * extent.y * extent.z;
+  float per_unit = std::cbrt(n / density / volume);
+
+  glm::ivec3 res = glm::clamp(glm::ivec3(extent * per_unit), glm::ivec3(1), glm::ivec3(GRID_MAX_RES));
+  while (static_cast<size_t>(res.x) * res.y * res.z > GRID_MAX_CELLS) {
+    res = glm::max(res / 2, glm::ivec3(1));
+  }
+  return res;
+}
+
+bool GridSuits(const std::vector<BoundingBox> &prims) {
+  if (prims.empty()) {
+    return false;
+  }
+
+  BoundingBox centre_bounds;
+  float min_size = MAX_DISTANCE, max_size = 0.0f;
+  for (const BoundingBox &b : prims) {
+    centre_bounds.Grow(b.Centre());
+    glm::vec3 e = b.max - b.min;
+    float size = glm::max(glm::max(e.x, e.y), e.z);
+    min_size = std::min(min_size, size);
+    max_size = std::max(max_size, size);
+  }
+
+  if (max_size > 2.0f * min_size) {
+    return false;
+  }
+
+  glm::ivec3 res = GridResolution(centre_bounds, prims.size(), GRID_CHECK_DENSITY);
+  glm::vec3 scale = glm::vec3(res) / glm::max(centre_bounds.max - centre_bounds.min, glm::vec3(EPSILON));
+  std::vector<char> filled(static_cast<size_t>(res.x) * res.y * res.z, 0);
+
+  for (const BoundingBox &b : prims) {
+    glm::ivec3 c = glm::clamp(glm::ivec3((b.Centre() - centre_bounds.min) * scale), glm::ivec3(0), res - 1);
+    filled[(static_cast<size_t>(c.z) * res.y + c.y) * res.x + c.x] = 1;
+  }
+
+  size_t empty = std::count(filled.begin(), filled.end(), 0);
+  return empty <= GRID_MAX_EMPTY * filled.size();
+}
+
+void Grid::Build(const std::vector<BoundingBox> &prims) {
+  cell_start.clear();
+  items.clear();
+
+  if (prims.empty()) {
+    return;
+  }
+
+  bounds = BoundingBox();
+  for (const BoundingBox &b : prims) bounds.Grow(b);
+
+  res = GridResolution(bounds, prims.size(), GRID_DENSITY);
+  cell_size = (bounds.max - bounds.min) / glm::vec3(res);
+  cell_size = glm::max(cell_size, glm::vec3(EPSILON));
+  inv_cell_size = 1.0f / cell_size;
+
+  // Count, then fill - every primitive goes in each cell its bounds overlap
+  std::vector<glm::ivec3> lo(prims.size()), hi(prims.size());
+  cell_start.assign(Cells() + 1, 0);
+
+  for (size_t i = 0; i < prims.size(); ++i) {
+    lo[i] = glm::clamp(glm::ivec3((prims[i].min - bounds.min) * inv_cell_size), glm::ivec3(0), res - 1);
+    hi[i] = glm::clamp(glm::ivec3((prims[i].max - bounds.min) * inv_cell_size), glm::ivec3(0), res - 1);
+    for (int z = lo[i].z; z <= hi[i].z; ++z)
+      for (int y = lo[i].y; y <= hi[i].y; ++y)
+        for (int x = lo[i].x; x <= hi[i].x; ++x)
+          cell_start[(static_cast<size_t>(z) * res.y + y) * res.x + x + 1]++;
+  }
+
+  for (size_t c = 0; c < Cells(); ++c) {
+    cell_start[c + 1] += cell_start[c];
+  }
+
+  items.resize(cell_start[Cells()]);
+  std::vector<uint32_t> fill(cell_start.begin(), cell_start.end() - 1);
+
+  for (size_t i = 0; i < prims.size(); ++i) {
+    for (int z = lo[i].z; z <= hi[i].z; ++z)
+      for (int y = lo[i].y; y <= hi[i].y; ++y)
+        for (int x = lo[i].x; x <= hi[i].x; ++x)
+          items[fill[(static_cast<size_t>(z) * res.y + y) * res.x + x]++] = i;
+  }
+}
@@ -0,0 +1,469 @@
+/**
+* @brief Integrators - the different ways of turning rays into pixel colours
+* @file integrator.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "integrator.hpp"
+#include "thread_pool.hpp"
+
+#include <cstdlib>
+
+using namespace std;
+
+static inline float RandomFloat() { return static_cast<float>(std::rand()) / RAND_MAX; }
+
+// Direction inside the cone around axis with the given cos of its half angle, for two
+// numbers in [0,1]. Uniform over the cone if they are
+
+static glm::vec3 ConeDirection(const glm::vec3 &axis, float cos_max, float u1, float u2) {
+  float z = 1.0f - u1 * (1.0f - cos_max);
+  float r = sqrt(std::max(0.0f, 1.0f - z * z));
+  float phi = 2.0f * static_cast<float>(PI) * u2;
+
+  glm::vec3 major_axis = fabs(axis.x) < 0.9f ? glm::vec3(1.0f,0,0) : glm::vec3(0,1.0f,0);
+  glm::vec3 u = glm::normalize(glm::cross(major_axis, axis));
+  glm::vec3 v = glm::cross(axis, u);
+
+  return glm::normalize(u * (cos(phi) * r) + v * (sin(phi) * r) + axis * z);
+}
+
+// Uniform random direction inside the cone around axis with the given cos of its half angle
+
+glm::vec3 SampleCone(const glm::vec3 &axis, float cos_max) {
+  float u1 = RandomFloat();
+  float u2 = RandomFloat();
+  return ConeDirection(axis, cos_max, u1, u2);
+}
+
+// Light arriving at origin from one light, through one shadow ray. Weighted by the
+// solid angle of the light over the hemisphere, as the uniform diffuse bounces in
+// TraceRay would see it, so the brightness matches the path tracer
+
+static glm::vec3 LightFrom(unsigned int i, const glm::vec3 &origin, const glm::vec3 &normal, const Scene &scene, OccluderCache &shadows) {
+  const Light &light = *scene.lights[i];
+  glm::vec3 to_light = light.pos - origin;
+  float dist2 = glm::dot(to_light, to_light);
+
+  if (dist2 <= light.radius * light.radius) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  float cos_max = sqrt(1.0f - (light.radius * light.radius) / dist2);
+  Ray shadow_ray(origin, SampleCone(to_light / sqrt(dist2), cos_max));
+
+  float dist;
+  if (glm::dot(shadow_ray.direction, normal) <= 0.0f || !light.Intersect(shadow_ray, MAX_DISTANCE, dist)) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  if (scene.Occluded(shadow_ray, dist - 0.001f, i, shadows)) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  // Solid angle of the light is 2 PI (1 - cos_max), over the 2 PI of the hemisphere
+  return light.colour * (1.0f - cos_max);
+}
+
+// Light arriving at loc from every light, and from the environment map if there is
+// one. With enough lights for a light BVH, one light is picked from it instead and
+// weighted by how likely it was to be picked, so the cost stays the same however many
+// lights there are
+
+glm::vec3 DirectLight(const glm::vec3 &loc, const glm::vec3 &normal, const Scene &scene, OccluderCache &shadows) {
+  glm::vec3 origin = loc + normal * 0.001f;
+  glm::vec3 light_colour = scene.environment ? EnvironmentLight(origin, normal, scene, false) : glm::vec3(0.0f,0.0f,0.0f);
+
+  if (!scene.light_bvh.Empty()) {
+    float pdf;
+    int i = scene.light_bvh.Sample(origin, normal, RandomFloat(), pdf);
+    if (i >= 0) {
+      light_colour += LightFrom(i, origin, normal, scene, shadows) / pdf;
+    }
+    return light_colour;
+  }
+
+  for (size_t i = 0; i < scene.lights.size(); ++i) {
+    light_colour += LightFrom(i, origin, normal, scene, shadows);
+  }
+
+  return light_colour;
+}
+
+glm::vec3 PathIntegrator::Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const {
+  return FireRays(x, y, options, scene, cache);
+}
+
+// Same supersampling pattern as FireRays, but each ray stops at its first hit
+
+glm::vec3 DirectIntegrator::Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const {
+  glm::vec3 pixel_colour(0.0f,0.0f,0.0f);
+
+  for (int i = 0; i < options.supersample; ++i){
+    float rx = RandomFloat() - 0.5f;
+    float ry = RandomFloat() - 0.5f;
+
+    glm::vec3 pixel_colour_inner(0.0f,0.0f,0.0f);
+
+    for (int j = 0; j < options.num_rays_per_pixel; ++j){
+      Ray ray = GenerateRay(float(x) + rx, float(y) + ry, options, scene.camera, cache);
+      PrimitiveHit prim;
+      glm::vec3 colour = scene.Sky(ray.direction);
+
+      if (scene.Intersect(ray, MAX_DISTANCE, prim)) {
+        if (prim.type == HIT_LIGHT) {
+          colour = scene.lights[prim.id]->colour;
+        } else {
+          RayHit hit;
+          const Material &material = scene.HitAttributes(ray, prim, hit);
+          colour = material.colour * DirectLight(hit.loc, hit.normal, scene, shadows);
+        }
+      }
+
+      pixel_colour_inner += colour * options.ray_intensity;
+    }
+
+    pixel_colour += maxv(pixel_colour_inner);
+  }
+
+  return pixel_colour / static_cast<float>(options.supersample);
+}
+
+static inline float Luminance(const glm::vec3 &c) { return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z; }
+
+// Light from one light along the direction u picks in its cone, weighted as LightFrom
+// weights it but with nothing in the way. Zero if the direction is below the surface
+
+static glm::vec3 LightAlong(const Light &light, const glm::vec2 &u, const glm::vec3 &origin, const glm::vec3 &normal, glm::vec3 &direction) {
+  glm::vec3 to_light = light.pos - origin;
+  float dist2 = glm::dot(to_light, to_light);
+
+  if (dist2 <= light.radius * light.radius) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  float cos_max = sqrt(1.0f - (light.radius * light.radius) / dist2);
+  direction = ConeDirection(to_light / sqrt(dist2), cos_max, u.x, u.y);
+
+  if (glm::dot(direction, normal) <= 0.0f) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  return light.colour * (1.0f - cos_max);
+}
+
+// The target samples are chosen by. Where the whole cone is above the surface it is
+// the same for any u, and the direction is not needed
+
+static float Target(const Scene &scene, int light, const glm::vec2 &u, const glm::vec3 &origin, const glm::vec3 &normal) {
+  const Light &l = *scene.lights[light];
+  glm::vec3 to_light = l.pos - origin;
+  float dist2 = glm::dot(to_light, to_light);
+
+  if (dist2 > l.radius * l.radius && glm::dot(to_light, normal) >= l.radius) {
+    return Luminance(l.colour) * (1.0f - sqrt(1.0f - (l.radius * l.radius) / dist2));
+  }
+
+  glm::vec3 direction;
+  return Luminance(LightAlong(l, u, origin, normal, direction));
+}
+
+void RestirIntegrator::Reservoir::Add(int l, const glm::vec2 &u, float weight, float count) {
+  w_sum += weight;
+  m += count;
+  if (weight > 0.0f && RandomFloat() * w_sum <= weight) {
+    light = l;
+    sample = u;
+  }
+}
+
+// Merge reservoirs kept at several surfaces into one for the first of them. Each
+// sample is weighted by how likely its own surface was to pick it against the others
+// (the balance heuristic), so a light bright for a neighbour but faint here is not
+// overcounted. counts may be lower than the reservoirs' own, to hold history back
+
+static RestirIntegrator::Reservoir Combine(const Scene &scene, int n, const RestirIntegrator::Reservoir *const *from,
+    const glm::vec3 *origins, const glm::vec3 *normals, const float *counts) {
+  RestirIntegrator::Reservoir r;
+
+  for (int i = 0; i < n; ++i) {
+    const RestirIntegrator::Reservoir &q = *from[i];
+    float weight = 0.0f;
+
+    if (q.light >= 0 && q.w > 0.0f) {
+      float here = 0.0f, mine = 0.0f, all = 0.0f;
+      for (int j = 0; j < n; ++j) {
+        float t = Target(scene, q.light, q.sample, origins[j], normals[j]);
+        all += counts[j] * t;
+        if (j == 0) here = t;
+        if (j == i) mine = counts[j] * t;
+      }
+      if (all > 0.0f) weight = mine / all * here * q.w;
+    }
+
+    r.Add(q.light, q.sample, weight, counts[i]);
+  }
+
+  float target = r.light >= 0 ? Target(scene, r.light, r.sample, origins[0], normals[0]) : 0.0f;
+  r.w = target > 0.0f ? r.w_sum / target : 0.0f;
+  return r;
+}
+
+// The pixel in a frame with these camera values that looks at p. The ray through a
+// pixel goes through (x, y, near, -1) after projection, so the pixel is read back from
+// the projected point divided through by -w
+
+static bool Reproject(const glm::vec3 &p, const glm::mat4 &view_proj, float ffx, float ffy, int width, int height, int &x, int &y) {
+  glm::vec4 c = view_proj * glm::vec4(p, 1.0f);
+  if (c.w == 0.0f) {
+    return false;
+  }
+
+  x = static_cast<int>(floor((-c.x / c.w / ffx + 1.0f) * 0.5f * width + 0.5f));
+  y = static_cast<int>(floor((-c.y / c.w / ffy + 1.0f) * 0.5f * height + 0.5f));
+  return x >= 0 && x < width && y >= 0 && y < height;
+}
+
+// First hits, candidates and the merge with last frame, for every pixel. The spatial
+// merge needs all of these finished, so it is left to Pixel
+
+void RestirIntegrator::BeginFrame(const RaytraceOptions &options, const Scene &scene, Cache &cache) {
+  bool history = width == options.width && height == options.height && !merged.empty();
+  width = options.width;
+  height = options.height;
+  size_t pixels = static_cast<size_t>(width) * height;
+
+  if (history) {
+    std::swap(last_surfaces, surfaces);
+    std::swap(last_reservoirs, merged);
+  }
+  surfaces.resize(pixels);
+  reservoirs.assign(pixels, Reservoir());
+  merged.assign(pixels, Reservoir());
+
+  size_t num_lights = scene.lights.size();
+  WorkQueue rows(height);
+
+  RunParallel(options, [&](unsigned int thread) {
+    int y;
+    while (rows.Next(y)) {
+      for (int x = 0; x < width; ++x) {
+        size_t idx = static_cast<size_t>(y) * width + x;
+        Surface &surface = surfaces[idx];
+        Ray ray = GenerateRay(float(x) + RandomFloat() - 0.5f, float(y) + RandomFloat() - 0.5f, options, scene.camera, cache);
+        PrimitiveHit prim;
+
+        if (!scene.Intersect(ray, MAX_DISTANCE, prim)) {
+          surface.kind = Surface::SKY;
+          surface.colour = scene.Sky(ray.direction);
+          continue;
+        }
+
+        if (prim.type == HIT_LIGHT) {
+          surface.kind = Surface::EMITTER;
+          surface.colour = scene.lights[prim.id]->colour;
+          continue;
+        }
+
+        RayHit hit;
+        const Material &material = scene.HitAttributes(ray, prim, hit);
+        surface.kind = Surface::DIFFUSE;
+        surface.loc = hit.loc;
+        surface.normal = hit.normal;
+        surface.colour = material.colour;
+        surface.depth = prim.dist;
+
+        if (num_lights == 0) {
+          continue;
+        }
+
+        // Candidates are drawn as DirectLight draws its one sample, and weighted by their
+        // target over the odds of that light being picked
+        Reservoir &r = reservoirs[idx];
+        glm::vec3 origin = hit.loc + hit.normal * 0.001f;
+
+        for (int k = 0; k < RESTIR_CANDIDATES; ++k) {
+          int i;
+          float pick;
+          if (!scene.light_bvh.Empty()) {
+            i = scene.light_bvh.Sample(origin, hit.normal, RandomFloat(), pick);
+          } else {
+            i = std::min(static_cast<int>(RandomFloat() * num_lights), static_cast<int>(num_lights) - 1);
+            pick = 1.0f / num_lights;
+          }
+
+          glm::vec2 u(RandomFloat(), RandomFloat());
+          float weight = i >= 0 ? Target(scene, i, u, origin, hit.normal) / pick : 0.0f;
+          r.Add(i, u, weight, 1.0f);
+        }
+
+        float target = r.light >= 0 ? Target(scene, r.light, r.sample, origin, hit.normal) : 0.0f;
+        r.w = target > 0.0f ? r.w_sum / (r.m * target) : 0.0f;
+
+        // Last frame's reservoir for the same surface, found through the last camera
+        int lx, ly;
+        if (!history || !Reproject(hit.loc, last_view_proj, last_ffx, last_ffy, width, height, lx, ly)) {
+          continue;
+        }
+
+        const Surface &last = last_surfaces[static_cast<size_t>(ly) * width + lx];
+        const Reservoir &q = last_reservoirs[static_cast<size_t>(ly) * width + lx];
+        if (last.kind != Surface::DIFFUSE || q.light < 0 || q.light >= static_cast<int>(num_lights) ||
+            glm::dot(last.normal, hit.normal) < 0.9f || glm::length(last.loc - hit.loc) > 0.1f * prim.dist) {
+          continue;
+        }
+
+        const Reservoir *from[2] = { &r, &q };
+        glm::vec3 origins[2] = { origin, last.loc + last.normal * 0.001f };
+        glm::vec3 normals[2] = { hit.normal, last.normal };
+        float counts[2] = { r.m, std::min(q.m, RESTIR_HISTORY * RESTIR_CANDIDATES) };
+        r = Combine(scene, 2, from, origins, normals, counts);
+      }
+    }
+  });
+
+  last_view_proj = glm::inverse(cache.inv_view_proj);
+  last_ffx = cache.ffx;
+  last_ffy = cache.ffy;
+}
+
+// Merge in a few neighbours, then one shadow ray for the sample kept. There is one
+// camera ray a pixel whatever the supersampling, but the brightness is that of -r rays
+// of the direct integrator, so the two can be swapped
+
+glm::vec3 RestirIntegrator::Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const {
+  size_t idx = static_cast<size_t>(y) * width + x;
+  const Surface &surface = surfaces[idx];
+  float scale = options.num_rays_per_pixel * options.ray_intensity;
+
+  if (surface.kind != Surface::DIFFUSE) {
+    return maxv(surface.colour * scale);
+  }
+
+  const Reservoir *from[RESTIR_NEIGHBOURS + 1] = { &reservoirs[idx] };
+  glm::vec3 origins[RESTIR_NEIGHBOURS + 1] = { surface.loc + surface.normal * 0.001f };
+  glm::vec3 normals[RESTIR_NEIGHBOURS + 1] = { surface.normal };
+  float counts[RESTIR_NEIGHBOURS + 1] = { reservoirs[idx].m };
+  int n = 1;
+
+  for (int k = 0; k < RESTIR_NEIGHBOURS; ++k) {
+    float angle = 2.0f * static_cast<float>(PI) * RandomFloat();
+    float dist = RESTIR_RADIUS * sqrt(RandomFloat());
+    int nx = x + static_cast<int>(floor(cos(angle) * dist + 0.5f));
+    int ny = y + static_cast<int>(floor(sin(angle) * dist + 0.5f));
+    if (nx < 0 || nx >= width || ny < 0 || ny >= height || (nx == x && ny == y)) {
+      continue;
+    }
+
+    size_t other = static_cast<size_t>(ny) * width + nx;
+    const Surface &neighbour = surfaces[other];
+    if (neighbour.kind != Surface::DIFFUSE || glm::dot(neighbour.normal, surface.normal) < 0.9f ||
+        fabs(neighbour.depth - surface.depth) > 0.1f * surface.depth) {
+      continue;
+    }
+
+    from[n] = &reservoirs[other];
+    origins[n] = neighbour.loc + neighbour.normal * 0.001f;
+    normals[n] = neighbour.normal;
+    counts[n] = reservoirs[other].m;
+    ++n;
+  }
+
+  glm::vec3 origin = origins[0];
+  Reservoir r = Combine(scene, n, from, origins, normals, counts);
+  merged[idx] = r;
+
+  // The environment map is sampled on its own, as DirectLight does
+  glm::vec3 light_colour = scene.environment ? EnvironmentLight(origin, surface.normal, scene, false) : glm::vec3(0.0f,0.0f,0.0f);
+
+  if (r.w > 0.0f) {
+    const Light &light = *scene.lights[r.light];
+    glm::vec3 direction;
+    glm::vec3 colour = LightAlong(light, r.sample, origin, surface.normal, direction);
+    Ray shadow_ray(origin, direction);
+
+    float dist;
+    if (light.Intersect(shadow_ray, MAX_DISTANCE, dist) && !scene.Occluded(shadow_ray, dist - 0.001f, r.light, shadows)) {
+      light_colour += colour * r.w;
+    }
+  }
+
+  return maxv(surface.colour * light_colour * scale);
+}
+
+// One occlusion ray per camera ray, averaged. The occlusion distance is a tenth of the
+// size of the scene
+
+glm::vec3 AOIntegrator::Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const {
+  float ao_distance = 0.1f * glm::length(1.0f / cache.bounds_inv_size);
+  float open = 0.0f;
+  int num_rays = options.supersample * options.num_rays_per_pixel;
+
+  for (int i = 0; i < num_rays; ++i){
+    Ray ray = GenerateRay(float(x) + RandomFloat() - 0.5f, float(y) + RandomFloat() - 0.5f, options, scene.camera, cache);
+    PrimitiveHit prim;
+
+    if (!scene.Intersect(ray, MAX_DISTANCE, prim) || prim.type == HIT_LIGHT) {
+      open += 1.0f;
+      continue;
+    }
+
+    RayHit hit;
+    scene.HitAttributes(ray, prim, hit);
+    Ray ao_ray(hit.loc + hit.normal * 0.001f, HemisphereDiffuseRay(hit.normal));
+
+    if (!scene.Occluded(ao_ray, ao_distance)) {
+      open += 1.0f;
+    }
+  }
+
+  float v = open / static_cast<float>(num_rays);
+  return glm::vec3(v, v, v);
+}
+
+std::string PreviewIntegrator::Name() const {
+  switch (channel) {
+    case DEPTH : return "depth";
+    case NORMAL : return "normal";
+    default : return "albedo";
+  }
+}
+
+// One ray, no randomness. Depth is 1.0 at the camera falling to 0.0 at the far plane
+
+glm::vec3 PreviewIntegrator::Pixel(int x, int y, const RaytraceOptions &options, const Scene &scene, Cache &cache, OccluderCache &shadows) const {
+  Ray ray = GenerateRay(float(x), float(y), options, scene.camera, cache);
+  PrimitiveHit prim;
+
+  if (!scene.Intersect(ray, MAX_DISTANCE, prim)) {
+    return channel == ALBEDO ? maxv(scene.Sky(ray.direction)) : glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  if (channel == DEPTH) {
+    float d = 1.0f - std::min(prim.dist / scene.camera->far(), 1.0f);
+    return glm::vec3(d, d, d);
+  }
+
+  if (prim.type == HIT_LIGHT) {
+    const Light &light = *scene.lights[prim.id];
+    glm::vec3 normal = glm::normalize(ray.direction * prim.dist + ray.origin - light.pos);
+    return channel == NORMAL ? normal * 0.5f + 0.5f : maxv(light.colour);
+  }
+
+  RayHit hit;
+  const Material &material = scene.HitAttributes(ray, prim, hit);
+  return channel == NORMAL ? hit.normal * 0.5f + 0.5f : material.colour;
+}
+
+std::shared_ptr<Integrator> CreateIntegrator(const std::string &name) {
+  if (name == "path") return std::shared_ptr<Integrator>(new PathIntegrator());
+  if (name == "direct") return std::shared_ptr<Integrator>(new DirectIntegrator());
+  if (name == "restir") return std::shared_ptr<Integrator>(new RestirIntegrator());
+  if (name == "ao") return std::shared_ptr<Integrator>(new AOIntegrator());
+  if (name == "depth") return std::shared_ptr<Integrator>(new PreviewIntegrator(PreviewIntegrator::DEPTH));
+  if (name == "normal") return std::shared_ptr<Integrator>(new PreviewIntegrator(PreviewIntegrator::NORMAL));
+  if (name == "albedo") return std::shared_ptr<Integrator>(new PreviewIntegrator(PreviewIntegrator::ALBEDO));
+  return nullptr;
+}
@@ -0,0 +1,151 @@
+/**
+* @brief Tree over the lights, for finding and sampling them in scenes with many
+* @file light_bvh.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "light_bvh.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+// Radiance times projected area, up to a constant. Only ever used as a ratio
+static float LightPower(const Light &light) {
+  float luminance = 0.2126f * light.colour.x + 0.7152f * light.colour.y + 0.0722f * light.colour.z;
+  return luminance * light.radius * light.radius;
+}
+
+void LightBvh::Build(const std::vector< std::shared_ptr<Light> > &scene_lights, const RaytraceOptions &options) {
+  lights.clear();
+  std::vector<BoundingBox> bounds;
+  for (const std::shared_ptr<Light> &l : scene_lights) {
+    lights.push_back(*l);
+    bounds.push_back(BoundingBox(l->pos - glm::vec3(l->radius), l->pos + glm::vec3(l->radius)));
+  }
+
+  bvh = Bvh();
+  power.clear();
+  if (lights.empty()) {
+    return;
+  }
+
+  bvh.Build(bounds, 1, options);
+  power.assign(bvh.nodes.size(), 0.0f);
+  SumPower(0);
+}
+
+float LightBvh::SumPower(uint32_t node) {
+  const BvhNode &n = bvh.nodes[node];
+  float sum = 0.0f;
+
+  if (n.IsLeaf()) {
+    for (uint32_t i = n.first; i < n.first + n.count; ++i) {
+      if (bvh.indices[i] != BVH_PADDING) sum += LightPower(lights[bvh.indices[i]]);
+    }
+  } else {
+    sum = SumPower(n.first) + SumPower(n.first + 1);
+  }
+
+  power[node] = sum;
+  return sum;
+}
+
+// The node's box is bounded by a sphere, and the cosine taken to the direction into
+// that sphere closest to the normal. From inside the sphere, any direction could lead
+// to a light, and the distance is clamped to the sphere's radius
+
+float LightBvh::Importance(uint32_t node, const glm::vec3 &loc, const glm::vec3 &normal) const {
+  const BvhNode &n = bvh.nodes[node];
+  glm::vec3 half = (n.max - n.min) * 0.5f;
+  glm::vec3 to_centre = n.min + half - loc;
+  float radius2 = std::max(glm::dot(half, half), EPSILON);
+  float dist2 = glm::dot(to_centre, to_centre);
+
+  if (dist2 <= radius2) {
+    return power[node] / radius2;
+  }
+
+  float dist = sqrt(dist2);
+  float cos_theta = glm::dot(to_centre, normal) / dist;
+  float sin_bound = sqrt(radius2 / dist2);
+  float cos_bound = sqrt(1.0f - radius2 / dist2);
+
+  float cos_near = 1.0f;
+  if (cos_theta < cos_bound) {
+    float sin_theta = sqrt(std::max(0.0f, 1.0f - cos_theta * cos_theta));
+    cos_near = cos_theta * cos_bound + sin_theta * sin_bound;
+  }
+
+  return cos_near > 0.0f ? power[node] * cos_near / dist2 : 0.0f;
+}
+
+int LightBvh::Sample(const glm::vec3 &loc, const glm::vec3 &normal, float u, float &pdf) const {
+  if (bvh.Empty() || Importance(0, loc, normal) <= 0.0f) {
+    return -1;
+  }
+
+  uint32_t node = 0;
+  pdf = 1.0f;
+
+  // u is stretched back over [0,1) at each level, so one number does for the whole walk
+  while (!bvh.nodes[node].IsLeaf()) {
+    uint32_t a = bvh.nodes[node].first;
+    float ia = Importance(a, loc, normal);
+    float ib = Importance(a + 1, loc, normal);
+    if (ia + ib <= 0.0f) {
+      return -1;
+    }
+
+    float pa = ia / (ia + ib);
+    if (u < pa) {
+      u /= pa;
+      pdf *= pa;
+      node = a;
+    } else {
+      u = (u - pa) / (1.0f - pa);
+      pdf *= 1.0f - pa;
+      node = a + 1;
+    }
+    u = std::min(u, 0.99999994f);
+  }
+
+  uint32_t light = bvh.indices[bvh.nodes[node].first];
+  return light == BVH_PADDING ? -1 : static_cast<int>(light);
+}
+
+int LightBvh::Intersect(const Ray &ray, float tmax, float &dist) const {
+  int best = -1;
+
+  bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+    for (uint32_t i = first; i < first + count; ++i) {
+      uint32_t id = bvh.indices[i];
+      if (id != BVH_PADDING && lights[id].Intersect(ray, tmax, dist)) {
+        tmax = dist;
+        best = id;
+      }
+    }
+    return false;
+  });
+
+  return best;
+}
+
+int LightBvh::Occludes(const Ray &ray, float tmax) const {
+  int blocker = -1;
+
+  bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+    for (uint32_t i = first; i < first + count; ++i) {
+      uint32_t id = bvh.indices[i];
+      if (id != BVH_PADDING && lights[id].Occludes(ray, tmax)) {
+        blocker = id;
+        return true;
+      }
+    }
+    return false;
+  });
+
+  return blocker;
+}
@@ -20,8 +20,6 @@
 #include <chrono>
 #include <thread>
 
-#include <omp.h>
-
 #ifdef _USE_MPI
 #include "mpi.hpp"
 #endif
@@ -42,6 +40,9 @@
 
 #include "main.hpp"
 #include "bmp.hpp"
+#include "simd_kernels.hpp"
+#include "thread_pool.hpp"
+#include "sequence.hpp"
 
 // Autogenerated with cmake
 #include "version.hpp"
@@ -68,11 +69,25 @@ void ParseCommandOptions (RaytraceOptions &options, int argc, const char * argv[
   static struct option long_options[] = {
       {"width", 1, 0, 0},
       {"height", 0, 0, 0},
+      {"batch", 0, 0, 'B'},
+      {"sort-rays", 0, 0, 'o'},
+      {"integrator", 1, 0, 'I'},
+      {"isa", 1, 0, 'V'},
+      {"threads", 1, 0, 't'},
+      {"thread-pool", 0, 0, 'P'},
+      {"end-frame", 1, 0, 'e'},
+      {"bvh", 1, 0, 'H'},
+      {"accel", 1, 0, 'A'},
+      {"compress-bvh", 0, 0, 'Q'},
+      {"bvh-layout", 1, 0, 'L'},
+      {"eager-meshes", 0, 0, 'E'},
+      {"out-of-core", 0, 0, 'C'},
+      {"mesh-budget", 1, 0, 'M'},
       {NULL, 0, NULL, 0}
   };
   int option_index = 0;
 
-  while ((c = getopt_long(argc, (char **)argv, "w:h:f:n:b:s:p:a:r:i:?x", long_options, &option_index)) != -1) {
+  while ((c = getopt_long(argc, (char **)argv, "w:h:f:n:b:s:p:a:r:i:?xBoI:V:t:Pe:H:A:QL:ECM:", long_options, &option_index)) != -1) {
   	int this_option_optind = optind ? optind : 1;
   	switch (c) {
       case 0 :
@@ -97,6 +112,18 @@ void ParseCommandOptions (RaytraceOptions &options, int argc, const char * argv[
         options.frame = FromStringS9<unsigned int>( std::string(optarg) );
         break;
 
+      case 'A' :
+        options.accel = std::string(optarg);
+        break;
+
+      case 'H' :
+        options.bvh_build = std::string(optarg);
+        break;
+
+      case 'e' :
+        options.end_frame = FromStringS9<unsigned int>( std::string(optarg) );
+        break;
+
       case 'b' :
         options.max_bounces = FromStringS9<unsigned int>( std::string(optarg) );
         break;
@@ -109,6 +136,50 @@ void ParseCommandOptions (RaytraceOptions &options, int argc, const char * argv[
         options.live = true;
         break;
 
+      case 'B' :
+        options.batched = true;
+        break;
+
+      case 'o' :
+        options.sort_rays = true;
+        break;
+
+      case 'I' :
+        options.integrator = std::string(optarg);
+        break;
+
+      case 'V' :
+        options.isa = std::string(optarg);
+        break;
+
+      case 't' :
+        options.threads = FromStringS9<unsigned int>( std::string(optarg) );
+        break;
+
+      case 'P' :
+        options.thread_pool = true;
+        break;
+
+      case 'Q' :
+        options.compress_bvh = true;
+        break;
+
+      case 'L' :
+        options.bvh_layout = std::string(optarg);
+        break;
+
+      case 'E' :
+        options.eager_meshes = true;
+        break;
+
+      case 'C' :
+        options.out_of_core = true;
+        break;
+
+      case 'M' :
+        options.mesh_budget = FromStringS9<unsigned int>( std::string(optarg) );
+        break;
+
       case 'h' :
         options.height = FromStringS9<unsigned int>( std::string(optarg) );
         break;
@@ -167,9 +238,24 @@ int main (int argc, const char * argv[]) {
   options.width = 320;
   options.height = 240;
   options.max_bounces = 10;
+  options.frame = 0;
+  options.end_frame = 0;
   options.live = false;
+  options.batched = false;
+  options.sort_rays = false;
   options.num_rays_per_pixel = 10;
   options.supersample = 4;
+  options.integrator = "path";
+  options.bvh_build = "sah";
+  options.bvh_layout = "treelet";
+  options.accel = "auto";
+  options.compress_bvh = false;
+  options.eager_meshes = false;
+  options.out_of_core = false;
+  options.mesh_budget = 0;
+  options.isa = "auto";
+  options.threads = 0;
+  options.thread_pool = false;
   options.output_filename = "test.bmp";
   options.scene_filename = "none";
   options.ray_intensity = 1.0f;
@@ -186,8 +272,26 @@ int main (int argc, const char * argv[]) {
 	std::cout << GetVersionString() << std::endl;
   std::cout << "Rendering size " << options.width << ", " << options.height <<  " for file: " << options.scene_filename << std::endl;
 
+  if (!SelectSimdKernels(options.isa.c_str())) {
+    std::cout << "Cannot use SIMD kernels for " << options.isa << " on this CPU" << std::endl;
+  }
+  std::cout << "SIMD kernels: " << GetSimdKernels().isa << std::endl;
+  std::cout << "NUMA nodes: " << NumaNodeCount() << std::endl;
+
   Scene scene = CreateScene(options);
 
+  // A frame range renders the whole sequence here, with the scene loaded just the once
+#ifndef _USE_CUDA
+  if (options.end_frame > options.frame) {
+    std::cout << "Rendering frames " << options.frame << " to " << options.end_frame << " with " << NumThreads(options) << " threads" << std::endl;
+    RenderSequence(options, scene);
+    return 0;
+  }
+#endif
+
+  PlaceCamera(scene, options.frame);
+  scene.Animate(options.frame, options);
+
   // Create the main buffer for our frame 
   RaytraceBitmap bitmap(options.width, options.height);
 
@@ -200,8 +304,8 @@ int main (int argc, const char * argv[]) {
 #endif
 
   // Main process - create our window as well if we want?
-  double time_total = omp_get_wtime();
-  std::cout << "Number of potential OpenMP Threads: " << omp_get_num_procs() << std::endl;
+  std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+  std::cout << "Rendering with " << NumThreads(options) << (options.thread_pool ? " pinned pool" : " OpenMP") << " threads" << std::endl;
 
 #ifdef _USE_CUDA
   RaytraceKernelCUDA(bitmap, options, scene);
@@ -209,8 +313,11 @@ int main (int argc, const char * argv[]) {
   RaytraceKernel(bitmap, options, scene);
 #endif
 
-  time_total = omp_get_wtime() - time_total; 
+  double time_total = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
   std::cout << "Time Total: " << time_total << "(s)" << std::endl;
+  if (options.mesh_budget > 0) {
+    std::cout << "Mesh file clusters evicted: " << MeshFile::Evictions() << std::endl;
+  }
 
   // Write out the bitmap  
   WriteBitmap(bitmap, options);
@@ -0,0 +1,247 @@
+/**
+* @brief Triangle meshes loaded from OBJ files
+* @file mesh.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "mesh.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+SimdTriangles PackedTriangles::View(size_t first, size_t count) const {
+  SimdTriangles view;
+  view.v0x = v0x.data() + first;
+  view.v0y = v0y.data() + first;
+  view.v0z = v0z.data() + first;
+  view.e1x = e1x.data() + first;
+  view.e1y = e1y.data() + first;
+  view.e1z = e1z.data() + first;
+  view.e2x = e2x.data() + first;
+  view.e2y = e2y.data() + first;
+  view.e2z = e2z.data() + first;
+  view.count = count;
+  return view;
+}
+
+bool Mesh::Load(const std::string &filename) {
+  std::ifstream obj_file(filename);
+  if (!obj_file.is_open()) {
+    return false;
+  }
+
+  std::vector<glm::vec3> vertices;
+  std::string line;
+
+  while (std::getline(obj_file, line)) {
+    std::istringstream iss(line);
+    std::string tag;
+    iss >> tag;
+
+    if (tag == "v") {
+      glm::vec3 v;
+      iss >> v.x >> v.y >> v.z;
+      vertices.push_back(v);
+
+    } else if (tag == "f") {
+
+      // Each corner is v, v/t, v//n or v/t/n - we only want the v. Negative indices
+      // count back from the latest vertex
+      std::vector<int> face;
+      std::string corner;
+      while (iss >> corner) {
+        int index = atoi(corner.c_str());
+        index = index < 0 ? static_cast<int>(vertices.size()) + index : index - 1;
+        if (index < 0 || index >= static_cast<int>(vertices.size())) break;
+        face.push_back(index);
+      }
+
+      for (size_t i = 2; i < face.size(); ++i) {
+        Triangle t;
+        t.v0 = vertices[face[0]];
+        t.v1 = vertices[face[i - 1]];
+        t.v2 = vertices[face[i]];
+
+        glm::vec3 n = glm::cross(t.v1 - t.v0, t.v2 - t.v0);
+        float len = glm::length(n);
+        if (len <= 0.0f) continue;    // Degenerate - can never be hit
+        t.normal = n / len;
+        triangles.push_back(t);
+        bounds.Grow(t.v0);
+        bounds.Grow(t.v1);
+        bounds.Grow(t.v2);
+      }
+    }
+  }
+
+  return true;
+}
+
+void Mesh::Build(const RaytraceOptions &options, const SimdKernels &kernels) {
+  std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+
+  if (options.bvh_build == "sbvh") {
+    bvh.BuildSpatial(triangles, kernels.width, options);
+  } else {
+    std::vector<BoundingBox> boxes(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+      boxes[i].Grow(triangles[i].v0);
+      boxes[i].Grow(triangles[i].v1);
+      boxes[i].Grow(triangles[i].v2);
+    }
+    bvh.Build(boxes, kernels.width, options);
+  }
+
+  size_t padded = bvh.indices.size();
+  packed.v0x.assign(padded, 0.0f); packed.v0y.assign(padded, 0.0f); packed.v0z.assign(padded, 0.0f);
+  packed.e1x.assign(padded, 0.0f); packed.e1y.assign(padded, 0.0f); packed.e1z.assign(padded, 0.0f);
+  packed.e2x.assign(padded, 0.0f); packed.e2y.assign(padded, 0.0f); packed.e2z.assign(padded, 0.0f);
+
+  for (size_t i = 0; i < padded; ++i) {
+    if (bvh.indices[i] == BVH_PADDING) continue;
+    const Triangle &t = triangles[bvh.indices[i]];
+    glm::vec3 e1 = t.v1 - t.v0;
+    glm::vec3 e2 = t.v2 - t.v0;
+    packed.v0x[i] = t.v0.x; packed.v0y[i] = t.v0.y; packed.v0z[i] = t.v0.z;
+    packed.e1x[i] = e1.x; packed.e1y[i] = e1.y; packed.e1z[i] = e1.z;
+    packed.e2x[i] = e2.x; packed.e2y[i] = e2.y; packed.e2z[i] = e2.z;
+  }
+
+  compressed = CompressedBvh();
+  size_t node_bytes = bvh.nodes.size() * sizeof(BvhNode);
+  if (options.compress_bvh) {
+    compressed.Build(bvh);
+    node_bytes = compressed.Memory();
+    BvhNodes().swap(bvh.nodes);
+    std::vector< std::vector<uint32_t> >().swap(bvh.levels);
+  }
+
+  double time_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+  size_t refs = bvh.References();
+  size_t bytes = node_bytes + padded * (sizeof(uint32_t) + 9 * sizeof(float));
+
+  std::cout << "Built " << options.bvh_build << (options.compress_bvh ? " compressed" : "") << " BVH over "
+    << triangles.size() << " triangles in " << time_build
+    << "(s), cost " << bvh.build_cost << ", " << refs << " references (+"
+    << (triangles.empty() ? 0.0f : 100.0f * (refs - triangles.size()) / triangles.size()) << "%), "
+    << node_bytes / 1024 << "KB of nodes, " << bytes / 1024 << "KB in all" << std::endl;
+
+  ready.store(true, std::memory_order_release);
+}
+
+void Mesh::BuildLocked(const RaytraceOptions &options, const SimdKernels &kernels) {
+  std::lock_guard<std::mutex> lock(build_mutex);
+  if (!Built()) {
+    Build(options, kernels);
+  }
+}
+
+bool Mesh::Save(const std::string &filename) const {
+  return Built() && !file && MeshFile::Write(filename, bvh, triangles, bounds);
+}
+
+bool Mesh::Map(const std::string &filename, const SimdKernels &kernels) {
+  std::shared_ptr<MeshFile> mapped(new MeshFile());
+  if (!mapped->Open(filename)) {
+    return false;
+  }
+
+  if (mapped->leaf_size % kernels.width != 0) {
+    std::cout << "Mesh file " << filename << " has leaves of " << mapped->leaf_size << " triangles, which the "
+      << kernels.isa << " kernels cannot read " << kernels.width << " at a time" << std::endl;
+    return false;
+  }
+
+  file = mapped;
+  bounds = file->bounds;
+  ready.store(true, std::memory_order_release);
+  return true;
+}
+
+int Mesh::Intersect(const Ray &ray, const SimdKernels &kernels, float tmax, float &dist) const {
+  SimdRay simd_ray = { ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z };
+  int best = -1;
+
+  auto leaf = [&](uint32_t first, uint32_t count) -> bool {
+    int slot = kernels.intersect_triangles(simd_ray, Batch(first, count), tmax, dist);
+    if (slot >= 0) {
+      tmax = dist;
+      best = file ? first + slot : bvh.indices[first + slot];
+    }
+    return false;
+  };
+
+  if (file) {
+    file->Traverse(ray.origin, ray.direction, tmax, leaf);
+  } else if (compressed.Empty()) {
+    bvh.Traverse(ray.origin, ray.direction, tmax, leaf);
+  } else {
+    compressed.Traverse(ray.origin, ray.direction, tmax, leaf);
+  }
+
+  return best;
+}
+
+bool Mesh::Occludes(const Ray &ray, const SimdKernels &kernels, float tmax) const {
+  SimdRay simd_ray = { ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z };
+  bool blocked = false;
+
+  auto leaf = [&](uint32_t first, uint32_t count) -> bool {
+    float dist;
+    blocked = kernels.intersect_triangles(simd_ray, Batch(first, count), tmax, dist) >= 0;
+    return blocked;
+  };
+
+  if (file) {
+    file->Traverse(ray.origin, ray.direction, tmax, leaf);
+  } else if (compressed.Empty()) {
+    bvh.Traverse(ray.origin, ray.direction, tmax, leaf);
+  } else {
+    compressed.Traverse(ray.origin, ray.direction, tmax, leaf);
+  }
+
+  return blocked;
+}
+
+Instance::Instance(std::shared_ptr<Mesh> m, const glm::mat4 &transform) : mesh(m), to_world(transform) {
+  to_mesh = glm::inverse(to_world);
+  normal_to_world = glm::transpose(glm::mat3(to_mesh));
+  identity = to_world == glm::mat4(1.0f);
+}
+
+Ray Instance::ToMesh(const Ray &ray) const {
+  if (identity) {
+    return ray;
+  }
+  Ray local(glm::vec3(to_mesh * glm::vec4(ray.origin, 1.0f)), glm::mat3(to_mesh) * ray.direction);
+  local.bounces = ray.bounces;
+  return local;
+}
+
+glm::vec3 Instance::WorldNormal(unsigned int triangle) const {
+  glm::vec3 n = mesh->Normal(triangle);
+  return identity ? n : glm::normalize(normal_to_world * n);
+}
+
+BoundingBox Instance::Bounds() const {
+  BoundingBox local = mesh->Bounds();
+  if (identity || local.min.x > local.max.x) {
+    return local;
+  }
+
+  BoundingBox world;
+  for (int corner = 0; corner < 8; ++corner) {
+    glm::vec3 p((corner & 1) ? local.max.x : local.min.x,
+                (corner & 2) ? local.max.y : local.min.y,
+                (corner & 4) ? local.max.z : local.min.z);
+    world.Grow(glm::vec3(to_world * glm::vec4(p, 1.0f)));
+  }
+  return world;
+}
@@ -0,0 +1,356 @@
+/**
+* @brief Built meshes stored in a file and mapped in, for meshes bigger than memory
+* @file mesh_file.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "mesh_file.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char MESH_FILE_MAGIC[8] = { 'R', 'A', 'Y', 'M', 'E', 'S', 'H', 0 };
+static const size_t MESH_FILE_PAGE = 4096;
+
+// Floats per triangle in a block - first vertex, two edges and the normal
+static const size_t MESH_FILE_FLOATS = 12;
+
+struct MeshFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t leaf_size;
+  uint64_t triangles;
+  uint64_t nodes;
+  uint64_t slots;             // Leaf order, with padding - a whole number of blocks
+  uint64_t nodes_offset;
+  uint64_t blocks_offset;     // On a cluster boundary
+  float min[3], max[3];
+};
+
+// Shared by every mapped mesh, as the budget is for all of them together
+
+static std::mutex registry_mutex;
+static std::vector<MeshFile*> registry;
+static std::atomic<size_t> budget(0);
+static std::atomic<size_t> resident(0);
+static std::atomic<size_t> evictions(0);
+static std::atomic<uint32_t> epoch(1);
+
+static size_t RoundUp(size_t n, size_t to) {
+  return (n + to - 1) / to * to;
+}
+
+static void PadTo(std::ofstream &out, size_t offset) {
+  static const char zeros[MESH_FILE_PAGE] = {};
+  size_t at = static_cast<size_t>(out.tellp());
+  while (at < offset) {
+    size_t n = std::min(offset - at, MESH_FILE_PAGE);
+    out.write(zeros, n);
+    at += n;
+  }
+}
+
+// Written beside the final name and renamed over it once complete and on disk, so
+// other runs mapping the old file keep it whole, and none can map a half written one
+
+bool MeshFile::Write(const std::string &filename, const Bvh &bvh, const std::vector<Triangle> &tris,
+    const BoundingBox &bounds) {
+  if (bvh.nodes.empty()) {
+    return false;
+  }
+
+  std::string temp = filename + ".tmp." + std::to_string(getpid());
+  bool written = WriteBlocks(temp, bvh, tris, bounds);
+
+  if (written) {
+    int temp_fd = open(temp.c_str(), O_RDONLY);
+    written = temp_fd >= 0 && fsync(temp_fd) == 0;
+    if (temp_fd >= 0) close(temp_fd);
+  }
+
+  if (!written || rename(temp.c_str(), filename.c_str()) != 0) {
+    unlink(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MeshFile::WriteBlocks(const std::string &filename, const Bvh &bvh, const std::vector<Triangle> &tris,
+    const BoundingBox &bounds) {
+  std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+  if (!out.is_open()) {
+    return false;
+  }
+
+  size_t w = bvh.leaf_size;
+  MeshFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MESH_FILE_MAGIC, sizeof(header.magic));
+  header.version = MESH_FILE_VERSION;
+  header.leaf_size = w;
+  header.triangles = tris.size();
+  header.nodes = bvh.nodes.size();
+  header.slots = bvh.indices.size();
+  header.nodes_offset = MESH_FILE_PAGE;
+  header.blocks_offset = RoundUp(header.nodes_offset + header.nodes * sizeof(BvhNode), MESH_CLUSTER_BYTES);
+  for (int a = 0; a < 3; ++a) {
+    header.min[a] = bounds.min[a];
+    header.max[a] = bounds.max[a];
+  }
+
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  PadTo(out, header.nodes_offset);
+  out.write(reinterpret_cast<const char*>(bvh.nodes.data()), header.nodes * sizeof(BvhNode));
+  PadTo(out, header.blocks_offset);
+
+  // Padding slots are left zero, so their edges are zero and they are never hit
+  std::vector<float> block(MESH_FILE_FLOATS * w);
+  for (size_t first = 0; first < bvh.indices.size(); first += w) {
+    std::fill(block.begin(), block.end(), 0.0f);
+
+    for (size_t s = 0; s < w; ++s) {
+      uint32_t id = bvh.indices[first + s];
+      if (id == BVH_PADDING) continue;
+      const Triangle &t = tris[id];
+      glm::vec3 e1 = t.v1 - t.v0;
+      glm::vec3 e2 = t.v2 - t.v0;
+      float values[MESH_FILE_FLOATS] = { t.v0.x, t.v0.y, t.v0.z, e1.x, e1.y, e1.z,
+                                         e2.x, e2.y, e2.z, t.normal.x, t.normal.y, t.normal.z };
+      for (size_t k = 0; k < MESH_FILE_FLOATS; ++k) block[k * w + s] = values[k];
+    }
+
+    out.write(reinterpret_cast<const char*>(block.data()), block.size() * sizeof(float));
+  }
+
+  out.close();
+  return !out.fail();
+}
+
+bool MeshFile::Open(const std::string &filename) {
+  fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(MeshFileHeader)) {
+    return false;
+  }
+
+  void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  base = static_cast<char*>(p);
+  size = st.st_size;
+
+  MeshFileHeader header;
+  memcpy(&header, base, sizeof(header));
+
+  // Every size is checked against the file before it is multiplied, so a damaged
+  // header cannot overflow its way past the checks
+  if (memcmp(header.magic, MESH_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != MESH_FILE_VERSION ||
+      header.leaf_size == 0 || header.leaf_size > SIMD_MAX_WIDTH || header.nodes == 0 ||
+      header.slots % header.leaf_size != 0 || header.triangles > header.slots ||
+      header.nodes_offset < sizeof(header) || header.nodes_offset > size ||
+      header.nodes > (size - header.nodes_offset) / sizeof(BvhNode) ||
+      header.nodes_offset + header.nodes * sizeof(BvhNode) > header.blocks_offset ||
+      header.blocks_offset > size || header.blocks_offset % MESH_CLUSTER_BYTES != 0 ||
+      header.slots / header.leaf_size > (size - header.blocks_offset) / (MESH_FILE_FLOATS * header.leaf_size * sizeof(float))) {
+    return false;
+  }
+
+  nodes = reinterpret_cast<const BvhNode*>(base + header.nodes_offset);
+  if (!CheckNodes(header.nodes, header.slots, header.leaf_size)) {
+    return false;
+  }
+
+  blocks = reinterpret_cast<const float*>(base + header.blocks_offset);
+  triangles = header.triangles;
+  leaf_size = header.leaf_size;
+  bounds = BoundingBox(glm::vec3(header.min[0], header.min[1], header.min[2]),
+                       glm::vec3(header.max[0], header.max[1], header.max[2]));
+
+  first_cluster = header.blocks_offset / MESH_CLUSTER_BYTES;
+  clusters = (size + MESH_CLUSTER_BYTES - 1) / MESH_CLUSTER_BYTES;
+  stamps.reset(new std::atomic<uint32_t>[clusters]);
+  for (size_t c = 0; c < clusters; ++c) stamps[c].store(0, std::memory_order_relaxed);
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.push_back(this);
+  return true;
+}
+
+// Children must be in the file, leaves must be whole blocks of real slots, and the tree
+// no deeper than the traversal stack. Walked once, as the nodes are a small part of
+// the file
+
+bool MeshFile::CheckNodes(uint64_t num_nodes, uint64_t slots, uint32_t width) const {
+  std::vector< std::pair<uint64_t, int> > stack(1, std::make_pair(0, 0));
+  uint64_t visited = 0;
+
+  while (!stack.empty()) {
+    uint64_t node = stack.back().first;
+    int depth = stack.back().second;
+    stack.pop_back();
+
+    const BvhNode &n = nodes[node];
+    if (++visited > num_nodes || depth >= 64) {
+      return false;
+    }
+
+    if (n.IsLeaf()) {
+      if (n.first % width != 0 || n.count > width || n.first + static_cast<uint64_t>(n.count) > slots) {
+        return false;
+      }
+    } else {
+      if (n.first + static_cast<uint64_t>(1) >= num_nodes) {
+        return false;
+      }
+      stack.push_back(std::make_pair(n.first, depth + 1));
+      stack.push_back(std::make_pair(n.first + static_cast<uint64_t>(1), depth + 1));
+    }
+  }
+
+  return true;
+}
+
+MeshFile::~MeshFile() {
+  if (stamps) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.erase(std::remove(registry.begin(), registry.end(), this), registry.end());
+    for (size_t c = 0; c < clusters; ++c) {
+      if (stamps[c].load(std::memory_order_relaxed) != 0) resident.fetch_sub(MESH_CLUSTER_BYTES);
+    }
+  }
+  if (base) {
+    munmap(base, size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+SimdTriangles MeshFile::View(size_t first, size_t count) const {
+  size_t w = leaf_size;
+  const float *block = blocks + first / w * MESH_FILE_FLOATS * w;
+
+  if (budget.load(std::memory_order_relaxed) > 0) {
+    Touch(reinterpret_cast<const char*>(block) - base, MESH_FILE_FLOATS * w * sizeof(float));
+  }
+
+  SimdTriangles view;
+  view.v0x = block;
+  view.v0y = block + w;
+  view.v0z = block + 2 * w;
+  view.e1x = block + 3 * w;
+  view.e1y = block + 4 * w;
+  view.e1z = block + 5 * w;
+  view.e2x = block + 6 * w;
+  view.e2y = block + 7 * w;
+  view.e2z = block + 8 * w;
+  view.count = count;
+  return view;
+}
+
+glm::vec3 MeshFile::Normal(uint32_t slot) const {
+  size_t w = leaf_size;
+  const float *block = blocks + slot / w * MESH_FILE_FLOATS * w;
+  size_t s = slot % w;
+
+  // The normals are the last three runs of the block
+  if (budget.load(std::memory_order_relaxed) > 0) {
+    Touch(reinterpret_cast<const char*>(block + 9 * w) - base, 3 * w * sizeof(float));
+  }
+
+  return glm::vec3(block[9 * w + s], block[10 * w + s], block[11 * w + s]);
+}
+
+// Every cluster the bytes from offset lie in is stamped, as blocks are not a whole
+// fraction of a cluster and some straddle two. Most leaves land in clusters already
+// stamped this pass, and cost a relaxed load per cluster
+
+void MeshFile::Touch(size_t offset, size_t bytes) const {
+  uint32_t now = epoch.load(std::memory_order_relaxed);
+  size_t last = (offset + bytes - 1) / MESH_CLUSTER_BYTES;
+
+  for (size_t c = offset / MESH_CLUSTER_BYTES; c <= last; ++c) {
+    std::atomic<uint32_t> &stamp = stamps[c];
+    if (stamp.load(std::memory_order_relaxed) == now) {
+      continue;
+    }
+
+    if (stamp.exchange(now, std::memory_order_relaxed) == 0 &&
+        resident.fetch_add(MESH_CLUSTER_BYTES, std::memory_order_relaxed) + MESH_CLUSTER_BYTES > budget.load(std::memory_order_relaxed)) {
+      Evict();
+    }
+  }
+}
+
+void MeshFile::Drop(size_t cluster) {
+  size_t offset = cluster * MESH_CLUSTER_BYTES;
+  size_t length = std::min(MESH_CLUSTER_BYTES, size - offset);
+  madvise(base + offset, length, MADV_DONTNEED);
+  posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+// Drop the least recently used clusters until a quarter of the budget is free, so
+// this happens now and then rather than on every new cluster. One thread does it
+// while the rest carry on tracing
+
+void MeshFile::Evict() {
+  std::unique_lock<std::mutex> lock(registry_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    return;
+  }
+
+  size_t limit = budget.load(std::memory_order_relaxed);
+  if (limit == 0 || resident.load(std::memory_order_relaxed) <= limit) {
+    return;
+  }
+
+  // Oldest stamp first. Anything used since the last pass has the current stamp,
+  // so only goes if there is nothing older left
+  typedef std::pair<uint32_t, std::pair<MeshFile*, size_t> > Used;
+  std::vector<Used> used;
+  for (MeshFile *file : registry) {
+    for (size_t c = file->first_cluster; c < file->clusters; ++c) {
+      uint32_t s = file->stamps[c].load(std::memory_order_relaxed);
+      if (s != 0) used.push_back(Used(s, std::make_pair(file, c)));
+    }
+  }
+  std::sort(used.begin(), used.end());
+  epoch.fetch_add(1, std::memory_order_relaxed);
+
+  size_t target = limit - limit / 4;
+  for (const Used &u : used) {
+    if (resident.load(std::memory_order_relaxed) <= target) break;
+    MeshFile *file = u.second.first;
+    size_t c = u.second.second;
+    if (file->stamps[c].exchange(0, std::memory_order_relaxed) != 0) {
+      file->Drop(c);
+      resident.fetch_sub(MESH_CLUSTER_BYTES, std::memory_order_relaxed);
+      evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+void MeshFile::SetBudget(size_t bytes) {
+  budget.store(bytes, std::memory_order_relaxed);
+}
+
+size_t MeshFile::Evictions() {
+  return evictions.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,126 @@
+/**
+* @brief NUMA placement and huge page backed allocation
+* @file numa.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "numa.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static const size_t LARGE_ALLOCATION = 64 * 1024;
+static const size_t HUGE_PAGE = 2 * 1024 * 1024;
+
+// Parse a sysfs cpu list such as "0-3,8-11"
+
+static std::vector<int> ParseCpuList(const std::string &list) {
+  std::vector<int> cpus;
+  std::istringstream iss(list);
+  std::string range;
+
+  while (std::getline(iss, range, ',')) {
+    size_t dash = range.find('-');
+    int first = atoi(range.substr(0, dash).c_str());
+    int last = dash == std::string::npos ? first : atoi(range.substr(dash + 1).c_str());
+    for (int c = first; c <= last; ++c) cpus.push_back(c);
+  }
+
+  return cpus;
+}
+
+static std::vector<int> NumaNodeCpus(int node) {
+  std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  std::getline(f, list);
+  return ParseCpuList(list);
+}
+
+// CPU to node table, read once
+
+static const std::vector<int>& CpuNodes() {
+  static std::vector<int> cpu_nodes = []() {
+    std::vector<int> nodes;
+    for (int node = 0; ; ++node) {
+      std::vector<int> cpus = NumaNodeCpus(node);
+      if (cpus.empty()) break;
+      for (int c : cpus) {
+        if (c >= static_cast<int>(nodes.size())) nodes.resize(c + 1, 0);
+        nodes[c] = node;
+      }
+    }
+    return nodes;
+  }();
+  return cpu_nodes;
+}
+
+int NumaNodeCount() {
+  int count = 1;
+  for (int n : CpuNodes()) {
+    if (n + 1 > count) count = n + 1;
+  }
+  return count;
+}
+
+int CurrentNumaNode() {
+  static thread_local int node = -1;
+  if (node < 0) {
+    int cpu = sched_getcpu();
+    const std::vector<int> &nodes = CpuNodes();
+    node = cpu >= 0 && cpu < static_cast<int>(nodes.size()) ? nodes[cpu] : 0;
+  }
+  return node;
+}
+
+void RunOnNumaNode(int node, const std::function<void()> &func) {
+  std::vector<int> cpus = NumaNodeCpus(node);
+
+  std::thread t([&cpus, &func]() {
+    if (!cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int c : cpus) CPU_SET(c, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    func();
+  });
+  t.join();
+}
+
+void* AllocateLarge(size_t bytes) {
+  if (bytes < LARGE_ALLOCATION) {
+    return malloc(bytes > 0 ? bytes : 1);
+  }
+
+  void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (bytes >= HUGE_PAGE) {
+    madvise(p, bytes, MADV_HUGEPAGE);
+  }
+#endif
+
+  return p;
+}
+
+void FreeLarge(void *p, size_t bytes) {
+  if (bytes < LARGE_ALLOCATION) {
+    free(p);
+  } else {
+    munmap(p, bytes);
+  }
+}
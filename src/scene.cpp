@@ -6,23 +6,723 @@
 *
 */
 
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
+#include <iostream>
+#include <map>
 #include <sstream>
 
+#include <sys/stat.h>
+
 #include "string_utils.hpp"
+#include "file.hpp"
 #include "scene.hpp"
 
 using namespace std;
 using namespace s9;
 
+SimdSpheres PackedSpheres::View() const {
+  SimdSpheres view;
+  view.cx = cx.data();
+  view.cy = cy.data();
+  view.cz = cz.data();
+  view.r2 = r2.data();
+  view.count = cx.size();
+  return view;
+}
+
+SimdSpheres PackedSpheres::View(size_t first, size_t count) const {
+  SimdSpheres view;
+  view.cx = cx.data() + first;
+  view.cy = cy.data() + first;
+  view.cz = cz.data() + first;
+  view.r2 = r2.data() + first;
+  view.count = count;
+  return view;
+}
+
+// Below this many spheres a brute force SIMD test beats walking a tree
+static const size_t BVH_MIN_SPHERES = 64;
+
+static BoundingBox SphereBox(const Sphere &sphere) {
+  glm::vec3 r(sphere.radius);
+  return BoundingBox(sphere.centre - r, sphere.centre + r);
+}
+
+void Scene::Pack(const RaytraceOptions &options) {
+  kernels = &GetSimdKernels();
+
+  sphere_bvh = Bvh();
+  sphere_grid = Grid();
+  sphere_tree.Clear();
+  sphere_leaf.clear();
+
+  if (options.accel == "dynamic") {
+    // However few spheres there are for now - edits may add more
+    std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      sphere_leaf.push_back(sphere_tree.Insert(SphereBox(*spheres[i]), i));
+    }
+    double time_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+    std::cout << "Inserted " << spheres.size() << " spheres into a dynamic BVH in " << time_build
+      << "(s), cost " << sphere_tree.Cost() << ", height " << sphere_tree.Height() << std::endl;
+
+  } else if (spheres.size() >= BVH_MIN_SPHERES) {
+    std::vector<BoundingBox> bounds = SphereBounds();
+    std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+
+    if (options.accel == "grid" || (options.accel == "auto" && GridSuits(bounds))) {
+      sphere_grid.Build(bounds);
+      double time_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+      std::cout << "Built " << sphere_grid.res.x << "x" << sphere_grid.res.y << "x" << sphere_grid.res.z << " grid over "
+        << spheres.size() << " spheres in " << time_build << "(s)" << std::endl;
+
+    } else {
+      // One SIMD batch per leaf
+      sphere_bvh.Build(bounds, kernels->width, options);
+      double time_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+      std::cout << "Built " << options.bvh_build << " BVH over " << spheres.size() << " spheres in " << time_build
+        << "(s), cost " << sphere_bvh.build_cost << std::endl;
+    }
+  }
+
+  // Meshes do not move, so their trees are built once. A mesh built mid render is
+  // built by the thread whose ray reached it, which cannot hand work to the render
+  // threads it is one of, so it builds alone. The tree over the instances goes on top,
+  // with one instance per leaf, from bounds found as the meshes were loaded
+  mesh_options = options;
+  mesh_options.threads = 1;
+  mesh_options.thread_pool = false;
+
+  if (options.eager_meshes) {
+    for (const std::shared_ptr<Mesh> &m : meshes) {
+      if (!m->Built()) m->Build(options, *kernels);
+    }
+  }
+
+  light_bvh = LightBvh();
+  if (lights.size() >= LIGHT_BVH_MIN) {
+    std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+    light_bvh.Build(lights, options);
+    double time_build = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+    std::cout << "Built light BVH over " << lights.size() << " lights in " << time_build << "(s)" << std::endl;
+  }
+
+  instance_bvh = Bvh();
+  if (!instances.empty()) {
+    std::vector<BoundingBox> bounds(instances.size());
+    size_t placed = 0;
+    for (size_t i = 0; i < instances.size(); ++i) {
+      bounds[i] = instances[i].Bounds();
+      placed += instances[i].mesh->Size();
+    }
+    instance_bvh.Build(bounds, 1, options);
+
+    size_t unique = 0;
+    for (const std::shared_ptr<Mesh> &m : meshes) unique += m->Size();
+    std::cout << "Placed " << instances.size() << " instances of " << meshes.size() << " meshes, "
+      << unique << " triangles stored for " << placed << " placed"
+      << (options.eager_meshes ? "" : ", built as rays reach them") << std::endl;
+  }
+
+  PackSpheres();
+}
+
+void Scene::PackSpheres() {
+  size_t padded = (spheres.size() + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+  if (!sphere_bvh.Empty()) {
+    padded = sphere_bvh.indices.size();
+  }
+
+  // Padding spheres have a negative radius squared, so they are never hit
+  packed_spheres.cx.assign(padded, 0.0f);
+  packed_spheres.cy.assign(padded, 0.0f);
+  packed_spheres.cz.assign(padded, 0.0f);
+  packed_spheres.r2.assign(padded, -1.0f);
+
+  for (size_t i = 0; i < padded; ++i) {
+    uint32_t id = sphere_bvh.Empty() ? i : sphere_bvh.indices[i];
+    if (id >= spheres.size()) continue;
+    packed_spheres.cx[i] = spheres[id]->centre.x;
+    packed_spheres.cy[i] = spheres[id]->centre.y;
+    packed_spheres.cz[i] = spheres[id]->centre.z;
+    packed_spheres.r2[i] = spheres[id]->radius * spheres[id]->radius;
+  }
+
+  // Copy made from a thread on each node, so first touch puts it there
+  node_spheres.clear();
+  int num_nodes = NumaNodeCount();
+  if (num_nodes > 1) {
+    node_spheres.resize(num_nodes);
+    for (int node = 0; node < num_nodes; ++node) {
+      RunOnNumaNode(node, [this, node]() { node_spheres[node] = packed_spheres; });
+    }
+  }
+}
+
+// Packed sphere i, or padding once i is past the end
+
+static void WritePacked(PackedSpheres &packed, size_t i, const std::vector< std::shared_ptr<Sphere> > &spheres) {
+  if (i >= packed.cx.size()) {
+    size_t padded = (i / SIMD_MAX_WIDTH + 1) * SIMD_MAX_WIDTH;
+    packed.cx.resize(padded, 0.0f);
+    packed.cy.resize(padded, 0.0f);
+    packed.cz.resize(padded, 0.0f);
+    packed.r2.resize(padded, -1.0f);
+  }
+
+  bool real = i < spheres.size();
+  packed.cx[i] = real ? spheres[i]->centre.x : 0.0f;
+  packed.cy[i] = real ? spheres[i]->centre.y : 0.0f;
+  packed.cz[i] = real ? spheres[i]->centre.z : 0.0f;
+  packed.r2[i] = real ? spheres[i]->radius * spheres[i]->radius : -1.0f;
+}
+
+void Scene::WriteSphere(size_t i) {
+  WritePacked(packed_spheres, i, spheres);
+  for (PackedSpheres &copy : node_spheres) WritePacked(copy, i, spheres);
+}
+
+void Scene::AddSphere(std::shared_ptr<Sphere> sphere, const RaytraceOptions &options) {
+  spheres.push_back(sphere);
+  if (options.accel != "dynamic") {
+    Pack(options);
+    return;
+  }
+
+  sphere_leaf.push_back(sphere_tree.Insert(SphereBox(*sphere), spheres.size() - 1));
+  WriteSphere(spheres.size() - 1);
+}
+
+void Scene::RemoveSphere(size_t index, const RaytraceOptions &options) {
+  size_t last = spheres.size() - 1;
+  spheres[index] = spheres[last];
+  spheres.pop_back();
+
+  if (options.accel != "dynamic") {
+    Pack(options);
+    return;
+  }
+
+  sphere_tree.Remove(sphere_leaf[index]);
+  if (index != last) {
+    sphere_leaf[index] = sphere_leaf[last];
+    sphere_tree.SetItem(sphere_leaf[index], index);
+  }
+  sphere_leaf.pop_back();
+
+  WriteSphere(index);
+  WriteSphere(last);
+}
+
+void Scene::MoveSphere(size_t index, const glm::vec3 &centre, const RaytraceOptions &options) {
+  spheres[index]->centre = centre;
+  if (options.accel != "dynamic") {
+    Pack(options);
+    return;
+  }
+
+  sphere_tree.Update(sphere_leaf[index], SphereBox(*spheres[index]));
+  WriteSphere(index);
+}
+
+void Scene::Animate(unsigned int frame, const RaytraceOptions &options) {
+  bool dynamic = options.accel == "dynamic";
+  bool moved = false;
+
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    Sphere &s = *spheres[i];
+    if (s.velocity != glm::vec3(0.0f)) {
+      s.centre = s.start + s.velocity * static_cast<float>(frame);
+      moved = true;
+
+      // Only the spheres that have left their leaf's margin touch the tree
+      if (dynamic) {
+        sphere_tree.Update(sphere_leaf[i], SphereBox(s));
+        WriteSphere(i);
+      }
+    }
+  }
+
+  if (!moved || dynamic) {
+    return;
+  }
+
+  // Grids are cheap enough to rebuild every frame
+  if (!sphere_grid.Empty()) {
+    sphere_grid.Build(SphereBounds());
+  }
+
+  if (sphere_bvh.Empty()) {
+    PackSpheres();
+    return;
+  }
+
+  sphere_bvh.Refit(SphereBounds(), options);
+
+  if (sphere_bvh.Degraded()) {
+    std::cout << "BVH cost has grown from " << sphere_bvh.build_cost << " to " << sphere_bvh.Cost() << " - rebuilding" << std::endl;
+    Pack(options);
+  } else {
+    PackSpheres();
+  }
+}
+
+std::vector<BoundingBox> Scene::SphereBounds() const {
+  std::vector<BoundingBox> bounds(spheres.size());
+  for (size_t i = 0; i < spheres.size(); ++i) {
+    bounds[i] = SphereBox(*spheres[i]);
+  }
+  return bounds;
+}
+
+// Spheres crossing cell boundaries turn up in more than one cell. A small mailbox of
+// what this ray has already tested skips most repeats - a collision just costs a retest
+
+static const uint32_t MAILBOX_SIZE = 32;
+
+// One packed sphere on its own, as the SIMD kernel does it - spheres behind us or hit
+// from inside are ignored
+
+static bool HitPackedSphere(const Ray &ray, const PackedSpheres &packed, uint32_t id, float tmax, float &dist) {
+  float ocx = ray.origin.x - packed.cx[id], ocy = ray.origin.y - packed.cy[id], ocz = ray.origin.z - packed.cz[id];
+  float l = ray.direction.x * ocx + ray.direction.y * ocy + ray.direction.z * ocz;
+  float p = l * l - (ocx * ocx + ocy * ocy + ocz * ocz) + packed.r2[id];
+  if (l > 0.0f || p <= 0.0f) return false;
+  float dist0 = -l - sqrt(p);
+  if (dist0 > 0.0f && dist0 < tmax) {
+    dist = dist0;
+    return true;
+  }
+  return false;
+}
+
+int Scene::IntersectSpheres(const Ray &ray, float tmax, float &dist) const {
+  SimdRay simd_ray = { ray.origin.x, ray.origin.y, ray.origin.z, ray.direction.x, ray.direction.y, ray.direction.z };
+  const PackedSpheres &packed = LocalSpheres();
+
+  if (!sphere_tree.Empty()) {
+    int best = -1;
+    sphere_tree.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t id) -> bool {
+      if (HitPackedSphere(ray, packed, id, tmax, dist)) {
+        tmax = dist;
+        best = id;
+      }
+      return false;
+    });
+    return best;
+  }
+
+  if (!sphere_grid.Empty()) {
+    uint32_t mailbox[MAILBOX_SIZE];
+    std::fill(mailbox, mailbox + MAILBOX_SIZE, BVH_PADDING);
+    int best = -1;
+
+    sphere_grid.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+      for (uint32_t i = first; i < first + count; ++i) {
+        uint32_t id = sphere_grid.items[i];
+        if (mailbox[id % MAILBOX_SIZE] == id) continue;
+        mailbox[id % MAILBOX_SIZE] = id;
+
+        if (HitPackedSphere(ray, packed, id, tmax, dist)) {
+          tmax = dist;
+          best = id;
+        }
+      }
+      return false;
+    });
+
+    return best;
+  }
+
+  if (sphere_bvh.Empty()) {
+    return kernels->intersect_spheres(simd_ray, packed.View(), tmax, dist);
+  }
+
+  int best = -1;
+  sphere_bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+    int slot = kernels->intersect_spheres(simd_ray, packed.View(first, count), tmax, dist);
+    if (slot >= 0) {
+      tmax = dist;
+      best = sphere_bvh.indices[first + slot];
+    }
+    return false;
+  });
+
+  return best;
+}
+
+const PackedSpheres& Scene::LocalSpheres() const {
+  if (node_spheres.empty()) {
+    return packed_spheres;
+  }
+  return node_spheres[CurrentNumaNode() % node_spheres.size()];
+}
+
+// Closest-hit test - each candidate only has to beat the current closest distance
+
+bool Scene::Intersect(const Ray &ray, float tmax, PrimitiveHit &prim) const {
+
+  float dist;
+
+  int sphere = IntersectSpheres(ray, tmax, dist);
+  if (sphere >= 0) {
+    tmax = dist;
+    prim.dist = dist;
+    prim.type = HIT_SPHERE;
+    prim.id = sphere;
+  }
+
+  if (IntersectMeshes(ray, tmax, prim)) {
+    tmax = prim.dist;
+  }
+
+  if (ground && ground->Intersect(ray, tmax, dist)) {
+    tmax = dist;
+    prim.dist = dist;
+    prim.type = HIT_GROUND;
+  }
+
+  if (!light_bvh.Empty()) {
+    int light = light_bvh.Intersect(ray, tmax, dist);
+    if (light >= 0) {
+      prim.dist = dist;
+      prim.type = HIT_LIGHT;
+      prim.id = light;
+    }
+  } else {
+    for (size_t i = 0; i < lights.size(); ++i) {
+      if (lights[i]->Intersect(ray, tmax, dist)) {
+        tmax = dist;
+        prim.dist = dist;
+        prim.type = HIT_LIGHT;
+        prim.id = i;
+      }
+    }
+  }
+
+  return prim.type != HIT_NONE;
+}
+
+bool Scene::IntersectMeshes(const Ray &ray, float tmax, PrimitiveHit &prim) const {
+  bool found = false;
+  float dist;
+
+  instance_bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+    for (uint32_t i = first; i < first + count; ++i) {
+      uint32_t id = instance_bvh.indices[i];
+      if (id == BVH_PADDING) continue;
+      const Instance &instance = instances[id];
+      instance.mesh->BuildOnce(mesh_options, *kernels);
+      int tri = instance.mesh->Intersect(instance.ToMesh(ray), *kernels, tmax, dist);
+      if (tri >= 0) {
+        tmax = dist;
+        prim.dist = dist;
+        prim.type = HIT_MESH;
+        prim.id = id;
+        prim.sub = tri;
+        found = true;
+      }
+    }
+    return false;
+  });
+
+  return found;
+}
+
+const Material& Scene::HitAttributes(const Ray &ray, const PrimitiveHit &prim, RayHit &hit) const {
+  hit.dist = prim.dist;
+  hit.loc = ray.direction * prim.dist + ray.origin;
+
+  if (prim.type == HIT_GROUND) {
+    hit.normal = glm::vec3(0.0f, 1.0f, 0.0f);
+    return *ground->material;
+  }
+
+  // Triangles are two sided, so the normal faces back along the ray
+  if (prim.type == HIT_MESH) {
+    const Instance &instance = instances[prim.id];
+    hit.normal = instance.WorldNormal(prim.sub);
+    if (glm::dot(hit.normal, ray.direction) > 0.0f) hit.normal = -hit.normal;
+    return instance.GetMaterial();
+  }
+
+  const Sphere &sphere = *spheres[prim.id];
+  hit.normal = sphere.Normal(hit.loc);
+  return *sphere.material;
+}
+
+// Any-hit test - the order is cheapest first, and we stop at the first blocker
+
+bool Scene::Occluded(const Ray &ray, float tmax) const {
+  PrimitiveHit occluder;
+  return Occluded(ray, tmax, occluder);
+}
+
+bool Scene::Occluded(const Ray &ray, float tmax, PrimitiveHit &occluder) const {
+
+  if (ground && ground->Occludes(ray, tmax)) {
+    occluder.type = HIT_GROUND;
+    return true;
+  }
+
+  if (!sphere_grid.Empty()) {
+    uint32_t mailbox[MAILBOX_SIZE];
+    std::fill(mailbox, mailbox + MAILBOX_SIZE, BVH_PADDING);
+    bool blocked = false;
+
+    sphere_grid.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+      for (uint32_t i = first; i < first + count; ++i) {
+        uint32_t id = sphere_grid.items[i];
+        if (mailbox[id % MAILBOX_SIZE] == id) continue;
+        mailbox[id % MAILBOX_SIZE] = id;
+        if (spheres[id]->Occludes(ray, tmax)) {
+          occluder.type = HIT_SPHERE;
+          occluder.id = id;
+          blocked = true;
+          return true;
+        }
+      }
+      return false;
+    });
+    if (blocked) return true;
+
+  } else if (!sphere_tree.Empty()) {
+    bool blocked = false;
+    sphere_tree.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t id) -> bool {
+      if (spheres[id]->Occludes(ray, tmax)) {
+        occluder.type = HIT_SPHERE;
+        occluder.id = id;
+        blocked = true;
+      }
+      return blocked;
+    });
+    if (blocked) return true;
+
+  } else if (!sphere_bvh.Empty()) {
+    bool blocked = false;
+    sphere_bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+      for (uint32_t i = first; i < first + count; ++i) {
+        uint32_t id = sphere_bvh.indices[i];
+        if (id != BVH_PADDING && spheres[id]->Occludes(ray, tmax)) {
+          occluder.type = HIT_SPHERE;
+          occluder.id = id;
+          blocked = true;
+          return true;
+        }
+      }
+      return false;
+    });
+    if (blocked) return true;
+
+  } else {
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      if (spheres[i]->Occludes(ray, tmax)) {
+        occluder.type = HIT_SPHERE;
+        occluder.id = i;
+        return true;
+      }
+    }
+  }
+
+  if (!instance_bvh.Empty()) {
+    bool blocked = false;
+    instance_bvh.Traverse(ray.origin, ray.direction, tmax, [&](uint32_t first, uint32_t count) -> bool {
+      for (uint32_t i = first; i < first + count; ++i) {
+        uint32_t id = instance_bvh.indices[i];
+        if (id == BVH_PADDING) continue;
+        instances[id].mesh->BuildOnce(mesh_options, *kernels);
+        if (instances[id].mesh->Occludes(instances[id].ToMesh(ray), *kernels, tmax)) {
+          occluder.type = HIT_MESH;
+          occluder.id = id;
+          blocked = true;
+          return true;
+        }
+      }
+      return false;
+    });
+    if (blocked) return true;
+  }
+
+  if (!light_bvh.Empty()) {
+    int light = light_bvh.Occludes(ray, tmax);
+    if (light >= 0) {
+      occluder.type = HIT_LIGHT;
+      occluder.id = light;
+      return true;
+    }
+    return false;
+  }
+
+  for (size_t i = 0; i < lights.size(); ++i) {
+    if (lights[i]->Occludes(ray, tmax)) {
+      occluder.type = HIT_LIGHT;
+      occluder.id = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Scene::Occluded(const Ray &ray, float tmax, unsigned int light, OccluderCache &cache) const {
+
+  if (cache.occluders.size() < lights.size()) {
+    cache.occluders.resize(lights.size());
+  }
+
+  PrimitiveHit &last = cache.occluders[light];
+  cache.queries++;
+
+  if (last.type != HIT_NONE && PrimitiveOccludes(ray, tmax, last)) {
+    cache.hits++;
+    return true;
+  }
+
+  // Remember whatever blocks this one, or clear the entry if nothing does
+  last = PrimitiveHit();
+  return Occluded(ray, tmax, last);
+}
+
+bool Scene::PrimitiveOccludes(const Ray &ray, float tmax, const PrimitiveHit &prim) const {
+  switch (prim.type) {
+    case HIT_SPHERE :
+      return spheres[prim.id]->Occludes(ray, tmax);
+    case HIT_GROUND :
+      return ground->Occludes(ray, tmax);
+    case HIT_LIGHT :
+      return lights[prim.id]->Occludes(ray, tmax);
+    case HIT_MESH :
+      return instances[prim.id].mesh->Occludes(instances[prim.id].ToMesh(ray), *kernels, tmax);
+    default :
+      return false;
+  }
+}
+
+void Scene::Occluded(const std::vector<Ray> &rays, const std::vector<float> &tmax, std::vector<char> &occluded) const {
+  occluded.resize(rays.size());
+  for (size_t i = 0; i < rays.size(); ++i) {
+    occluded[i] = Occluded(rays[i], tmax[i]) ? 1 : 0;
+  }
+}
+
+// Out of core, each OBJ file is built into a mesh file next to it, which is mapped
+// in its place from then on, without the OBJ being read again. Only that first build
+// needs the whole mesh in memory, and it can be made on a bigger machine. The leaves
+// are always SIMD_MAX_WIDTH wide, which every kernel can read, so machines with
+// different instruction sets share the one file. Any other file is rebuilt; the new
+// one is renamed over it, so runs already mapping the old one keep their copy
+
+static bool MapOutOfCore(Mesh &mesh, const std::string &filename, const RaytraceOptions &options) {
+  const SimdKernels &kernels = GetSimdKernels();
+  std::string mapped = filename + MESH_FILE_EXTENSION;
+
+  struct stat mapped_info, obj_info;
+  bool current = stat(mapped.c_str(), &mapped_info) == 0 &&
+    (stat(filename.c_str(), &obj_info) != 0 || mapped_info.st_mtime >= obj_info.st_mtime);
+  if (current && mesh.Map(mapped, kernels)) {
+    return true;
+  }
+
+  {
+    Mesh built;
+    if (!built.Load(filename)) {
+      return false;
+    }
+
+    RaytraceOptions build_options = options;
+    build_options.compress_bvh = false;
+    SimdKernels widest = kernels;
+    widest.width = SIMD_MAX_WIDTH;
+    built.Build(build_options, widest);
+    if (!built.Save(mapped)) {
+      std::cout << "Cannot write mesh file " << mapped << std::endl;
+      return false;
+    }
+  }
+
+  return mesh.Map(mapped, kernels);
+}
+
+// Directory part of a path, or empty if it has none. Plain string work, as s9::File
+// only takes paths starting with / or . and asserts on a bare scene.txt
+
+static std::string DirectoryOf(const std::string &path) {
+  size_t i = path.rfind('/');
+  return i == std::string::npos ? std::string() : path.substr(0, i);
+}
+
+// A file named in the scene - as given if it exists, otherwise relative to the scene
+// file
+
+static std::string ScenePath(const std::string &filename, const RaytraceOptions &options) {
+  if (Path::Exists(filename)) {
+    return filename;
+  }
+
+  std::string directory = DirectoryOf(options.scene_filename);
+  return directory.empty() ? filename : directory + "/" + filename;
+}
+
+// Each OBJ file is read once, however many times it is placed, from M and I lines alike
+
+static std::shared_ptr<Mesh> FindMesh(Scene &scene, std::map<std::string, std::shared_ptr<Mesh> > &loaded,
+    std::string filename, const RaytraceOptions &options) {
+  filename = ScenePath(filename, options);
+
+  std::map<std::string, std::shared_ptr<Mesh> >::iterator it = loaded.find(filename);
+  if (it != loaded.end()) {
+    return it->second;
+  }
+
+  std::shared_ptr<Mesh> mesh(new Mesh());
+  std::string extension(MESH_FILE_EXTENSION);
+  std::string mapped;
+  bool found;
+
+  if (filename.size() > extension.size() &&
+      filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0) {
+    mapped = filename;
+    found = mesh->Map(filename, GetSimdKernels());
+  } else if (options.out_of_core) {
+    mapped = filename + extension;
+    found = MapOutOfCore(*mesh, filename, options);
+  } else {
+    found = mesh->Load(filename);
+  }
+
+  if (!found) {
+    std::cout << "Cannot read mesh " << filename << std::endl;
+
+    // A mesh file that is there but cannot be used would otherwise leave the mesh out
+    // of every frame, with just the line above to say so
+    if (!mapped.empty() && Path::Exists(mapped)) {
+      std::cout << "Stopping, as mesh file " << mapped << " cannot be mapped" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    return std::shared_ptr<Mesh>();
+  }
+  mesh->material = std::shared_ptr<Material> (new Material());
+  scene.meshes.push_back(mesh);
+  loaded[filename] = mesh;
+  std::cout << (mesh->file ? "Mapped Mesh " : "Added Mesh ") << filename << " with " << mesh->Size() << " triangles" << std::endl;
+  return mesh;
+}
+
 // Create some test geometry for our scene
 // We read from a file with the following format
-// S x y z radius mr mg mb shiny    // Sphere details
+// S x y z radius mr mg mb shiny [vx vy vz]   // Sphere details, optional velocity per frame
+// D x y z radius ior ar ag ab [vx vy vz]      // Glass sphere, with its absorption
 // L r g b x y z                    // Lights
+// E filename [scale]               // HDR environment map, in place of the sky colour
 
 Scene CreateScene(RaytraceOptions &options){
 
   Scene scene;
+  std::map<std::string, std::shared_ptr<Mesh> > loaded;
+  MeshFile::SetBudget(static_cast<size_t>(options.mesh_budget) << 20);
 
   scene.sky_colour = glm::vec3(0,0,0);
 
@@ -39,16 +739,28 @@ Scene CreateScene(RaytraceOptions &options){
       if (StringBeginsWith(line,"S")){
         std::string s;
         float x,y,z,r, mr, mg, mb, sy;
-        iss >> s >> x >> y >> z >> r >> mr >> mg >> mb >> sy; 
+        float vx = 0, vy = 0, vz = 0;
+        iss >> s >> x >> y >> z >> r >> mr >> mg >> mb >> sy >> vx >> vy >> vz; 
         std::shared_ptr<Sphere> ss(new Sphere(glm::vec3(x,y,z),r));
+        ss->velocity = glm::vec3(vx,vy,vz);
         std::shared_ptr<Material> mm (new Material( glm::vec3(mr,mg,mb), sy));
         ss->material = mm;
         scene.spheres.push_back(ss);
         std::cout << "Added Sphere at " << x << ", " << y << ", " << z << std::endl;
-  
-        // push back a new lambda function that acts as a closure    
-        auto hitfunc = [ss](const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m) { m = ss->material; return ss->RayIntersection(ray,hit); };
-        scene.intersection_funcs.push_back(hitfunc);
+
+      } else if (StringBeginsWith(line,"D")){
+        std::string s;
+        float x,y,z,r, ior, ar, ag, ab;
+        float vx = 0, vy = 0, vz = 0;
+        iss >> s >> x >> y >> z >> r >> ior >> ar >> ag >> ab >> vx >> vy >> vz;
+        std::shared_ptr<Sphere> ss(new Sphere(glm::vec3(x,y,z),r));
+        ss->velocity = glm::vec3(vx,vy,vz);
+        std::shared_ptr<Material> mm (new Material( glm::vec3(1.0f), 0.0f));
+        mm->ior = ior;
+        mm->absorption = glm::vec3(ar,ag,ab);
+        ss->material = mm;
+        scene.spheres.push_back(ss);
+        std::cout << "Added Glass Sphere at " << x << ", " << y << ", " << z << std::endl;
 
       } else if (StringBeginsWith(line,"L")){
         std::string s;
@@ -89,10 +801,63 @@ Scene CreateScene(RaytraceOptions &options){
         iss >> s >> sr >> sg >> sb; 
         scene.sky_colour = glm::vec3(sr,sg,sb);
 
+      } else if (StringBeginsWith(line,"E")){
+        std::string s, filename;
+        float scale = 1.0f;
+        iss >> s >> filename >> scale;
+        filename = ScenePath(filename, options);
+
+        std::shared_ptr<Environment> environment(new Environment());
+        if (!environment->Load(filename, scale)) {
+          std::cout << "Cannot read environment map " << filename << std::endl;
+          continue;
+        }
+        scene.environment = environment;
+        std::cout << "Added Environment " << filename << " at " << environment->width << "x" << environment->height << std::endl;
+
+      } else if (StringBeginsWith(line,"M")){
+        std::string s, filename;
+        float mr, mg, mb, ms;
+        iss >> s >> filename >> mr >> mg >> mb >> ms;
+
+        // Placed as it is, and its material is the default for later instances
+        std::shared_ptr<Mesh> mesh = FindMesh(scene, loaded, filename, options);
+        if (!mesh) continue;
+        mesh->material = std::shared_ptr<Material> (new Material( glm::vec3(mr,mg,mb), ms));
+        scene.instances.push_back(Instance(mesh, glm::mat4(1.0f)));
+
+      } else if (StringBeginsWith(line,"I")){
+        std::string s, filename;
+        float tx, ty, tz, rx, ry, rz, sc, mr, mg, mb, ms;
+        iss >> s >> filename >> tx >> ty >> tz >> rx >> ry >> rz >> sc;
+
+        std::shared_ptr<Mesh> mesh = FindMesh(scene, loaded, filename, options);
+        if (!mesh) continue;
+
+        // Scaled, then rotated about x, y and z in turn (degrees), then moved
+        glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(tx,ty,tz));
+        transform = glm::rotate(transform, glm::radians(rz), glm::vec3(0.0f, 0.0f, 1.0f));
+        transform = glm::rotate(transform, glm::radians(ry), glm::vec3(0.0f, 1.0f, 0.0f));
+        transform = glm::rotate(transform, glm::radians(rx), glm::vec3(1.0f, 0.0f, 0.0f));
+        transform = glm::scale(transform, glm::vec3(sc));
+
+        Instance instance(mesh, transform);
+        if (iss >> mr >> mg >> mb >> ms) {
+          instance.material = std::shared_ptr<Material> (new Material( glm::vec3(mr,mg,mb), ms));
+        }
+        scene.instances.push_back(instance);
+
+      } else if (StringBeginsWith(line,"P")){
+        std::string s;
+        CameraKey key;
+        iss >> s >> key.frame >> key.eye.x >> key.eye.y >> key.eye.z >> key.look.x >> key.look.y >> key.look.z;
+        scene.camera_path.AddKey(key);
+
       }
  
     }
 
+    scene.Pack(options);
     return scene;
   } 
 
@@ -122,18 +887,6 @@ Scene CreateScene(RaytraceOptions &options){
   s2->material = m2;
   s3->material = m3;
 
-  auto hitfunc0 = [s0](const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m) { m = s0->material; return s0->RayIntersection(ray,hit); };
-  scene.intersection_funcs.push_back(hitfunc0);
-
-  auto hitfunc1 = [s1](const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m) { m = s1->material; return s1->RayIntersection(ray,hit); };
-  scene.intersection_funcs.push_back(hitfunc1);
-
-  auto hitfunc2 = [s2](const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m) { m = s2->material; return s2->RayIntersection(ray,hit); };
-  scene.intersection_funcs.push_back(hitfunc2);
-
-  auto hitfunc3 = [s3](const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m) { m = s3->material; return s3->RayIntersection(ray,hit); };
-  scene.intersection_funcs.push_back(hitfunc3);
-
   scene.spheres.push_back(s0);
   scene.spheres.push_back(s1);
   scene.spheres.push_back(s2);
@@ -156,6 +909,7 @@ Scene CreateScene(RaytraceOptions &options){
   
   scene.sky_colour = glm::vec3(0.0846f, 0.0933f, 0.0949f);
 
+  scene.Pack(options);
   return scene;
 }
 
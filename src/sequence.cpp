@@ -0,0 +1,177 @@
+/**
+* @brief Rendering animation sequences in a single process
+* @file sequence.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "sequence.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <iostream>
+#include <memory>
+
+#include "bmp.hpp"
+#include "file.hpp"
+#include "scene.hpp"
+#include "tracer.hpp"
+
+using namespace std;
+
+void CameraPath::AddKey(const CameraKey &key) {
+  keys.push_back(key);
+  std::stable_sort(keys.begin(), keys.end(), [](const CameraKey &a, const CameraKey &b) { return a.frame < b.frame; });
+}
+
+// Catmull-Rom through p1 and p2, with p0 and p3 setting the tangents
+
+static glm::vec3 CatmullRom(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3, float t) {
+  float t2 = t * t;
+  float t3 = t2 * t;
+  return 0.5f * ((2.0f * p1) + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 + (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+}
+
+void CameraPath::Evaluate(float frame, glm::vec3 &eye, glm::vec3 &look) const {
+  if (frame <= keys.front().frame) {
+    eye = keys.front().eye;
+    look = keys.front().look;
+    return;
+  }
+
+  if (frame >= keys.back().frame) {
+    eye = keys.back().eye;
+    look = keys.back().look;
+    return;
+  }
+
+  size_t i = 0;
+  while (keys[i + 1].frame <= frame) ++i;
+
+  // The end keys are repeated to give the spline its outer control points
+  const CameraKey &k0 = keys[i > 0 ? i - 1 : i];
+  const CameraKey &k1 = keys[i];
+  const CameraKey &k2 = keys[i + 1];
+  const CameraKey &k3 = keys[i + 2 < keys.size() ? i + 2 : i + 1];
+
+  float t = (frame - k1.frame) / (k2.frame - k1.frame);
+  eye = CatmullRom(k0.eye, k1.eye, k2.eye, k3.eye, t);
+  look = CatmullRom(k0.look, k1.look, k2.look, k3.look, t);
+}
+
+// The pattern is never handed to printf, as a stray %s in a file name would read the
+// frame number as a pointer. It is filled in here instead, if it has exactly one %d,
+// %i or %u, with an optional width and leading 0, and any number of %%
+
+static bool FillPattern(const std::string &pattern, unsigned int frame, std::string &filename) {
+  std::string result;
+  bool filled = false;
+
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    if (pattern[i] != '%') {
+      result += pattern[i];
+      continue;
+    }
+
+    if (i + 1 < pattern.size() && pattern[i + 1] == '%') {
+      result += '%';
+      ++i;
+      continue;
+    }
+
+    size_t end = i + 1;
+    while (end < pattern.size() && isdigit(static_cast<unsigned char>(pattern[end]))) ++end;
+    if (filled || end == pattern.size() || end - i > 3 || (pattern[end] != 'd' && pattern[end] != 'i' && pattern[end] != 'u')) {
+      return false;
+    }
+
+    bool zeros = pattern[i + 1] == '0';
+    int width = end > i + 1 ? atoi(pattern.substr(i + 1, end - i - 1).c_str()) : 0;
+    char number[128];
+    snprintf(number, sizeof(number), zeros ? "%0*u" : "%*u", width, frame);
+    result += number;
+    filled = true;
+    i = end;
+  }
+
+  if (filled) {
+    filename = result;
+  }
+  return filled;
+}
+
+std::string FrameFilename(const std::string &pattern, unsigned int frame) {
+  std::string filename;
+  if (FillPattern(pattern, frame, filename)) {
+    return filename;
+  }
+
+  char number[16];
+  snprintf(number, sizeof(number), "%04u", frame);
+
+  size_t dot = pattern.rfind('.');
+  if (dot == std::string::npos) {
+    return pattern + number;
+  }
+  return pattern.substr(0, dot) + number + pattern.substr(dot);
+}
+
+void PlaceCamera(Scene &scene, unsigned int frame) {
+  if (scene.camera_path.Empty()) {
+    return;
+  }
+
+  glm::vec3 eye, look;
+  scene.camera_path.Evaluate(static_cast<float>(frame), eye, look);
+  scene.camera->position(eye);
+  scene.camera->lookat(look);
+}
+
+void RenderSequence(const RaytraceOptions &options, Scene &scene) {
+
+  // Two frame buffers - one being rendered while the other is written out
+  RaytraceBitmap bitmaps[2] = { RaytraceBitmap(options.width, options.height), RaytraceBitmap(options.width, options.height) };
+  std::future<void> writing[2];
+  RaytraceOptions frame_options[2] = { options, options };
+  int current = 0;
+
+  for (unsigned int frame = options.frame; frame <= options.end_frame; ++frame) {
+    std::string filename = FrameFilename(options.output_filename, frame);
+
+    if (s9::Path::Exists(filename)) {
+      std::cout << "Frame " << frame << " already exists in " << filename << " - skipping" << std::endl;
+      continue;
+    }
+
+    // Wait until this buffer has finished being written from two frames ago
+    if (writing[current].valid()) {
+      writing[current].get();
+    }
+
+    PlaceCamera(scene, frame);
+    scene.Animate(frame, options);
+
+    std::chrono::steady_clock::time_point time_start = std::chrono::steady_clock::now();
+    RaytraceKernel(bitmaps[current], options, scene);
+    double time_frame = std::chrono::duration<double>(std::chrono::steady_clock::now() - time_start).count();
+    std::cout << "Frame " << frame << " Time: " << time_frame << "(s)" << std::endl;
+
+    frame_options[current].output_filename = filename;
+    RaytraceBitmap *bitmap = &bitmaps[current];
+    RaytraceOptions *frame_option = &frame_options[current];
+    writing[current] = std::async(std::launch::async, [bitmap, frame_option]() { WriteBitmap(*bitmap, *frame_option); });
+
+    current = 1 - current;
+  }
+
+  for (int i = 0; i < 2; ++i) {
+    if (writing[i].valid()) {
+      writing[i].get();
+    }
+  }
+}
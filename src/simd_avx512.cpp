@@ -0,0 +1,15 @@
+/**
+* @brief Kernels built for avx512 - see the compile flags in CMakeLists.txt
+* @file simd_avx512.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#define SIMD_NAMESPACE simd_avx512
+#include "simd_kernels_impl.hpp"
+
+const SimdKernels& SimdKernelsAVX512() {
+  static const SimdKernels kernels = SIMD_NAMESPACE::MakeKernels<16>("avx512");
+  return kernels;
+}
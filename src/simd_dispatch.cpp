@@ -0,0 +1,64 @@
+/**
+* @brief Pick the kernels for the CPU we are running on
+* @file simd_dispatch.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "simd_kernels.hpp"
+
+#include <string.h>
+
+// Seed each stream differently - xorshift must never have a zero state
+
+SimdRandom::SimdRandom(uint32_t seed) {
+  for (size_t i = 0; i < SIMD_MAX_WIDTH; ++i) {
+    uint32_t s = (seed + static_cast<uint32_t>(i)) * 2654435761u;
+    state[i] = s != 0 ? s : 0x9E3779B9u;
+  }
+}
+
+static bool CpuSupports(const char *isa) {
+  __builtin_cpu_init();
+  if (strcmp(isa, "sse2") == 0) return true;
+  if (strcmp(isa, "sse4.2") == 0) return __builtin_cpu_supports("sse4.2");
+  if (strcmp(isa, "avx2") == 0) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (strcmp(isa, "avx512") == 0) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return false;
+}
+
+static const SimdKernels& BestKernels() {
+  if (CpuSupports("avx512")) return SimdKernelsAVX512();
+  if (CpuSupports("avx2")) return SimdKernelsAVX2();
+  if (CpuSupports("sse4.2")) return SimdKernelsSSE42();
+  return SimdKernelsSSE2();
+}
+
+// Set before rendering starts, from the main thread
+static const SimdKernels *selected_kernels = nullptr;
+
+const SimdKernels& GetSimdKernels() {
+  if (selected_kernels == nullptr) {
+    selected_kernels = &BestKernels();
+  }
+  return *selected_kernels;
+}
+
+bool SelectSimdKernels(const char *isa) {
+  if (strcmp(isa, "auto") == 0) {
+    selected_kernels = &BestKernels();
+    return true;
+  }
+
+  if (!CpuSupports(isa)) {
+    return false;
+  }
+
+  if (strcmp(isa, "sse2") == 0) selected_kernels = &SimdKernelsSSE2();
+  else if (strcmp(isa, "sse4.2") == 0) selected_kernels = &SimdKernelsSSE42();
+  else if (strcmp(isa, "avx2") == 0) selected_kernels = &SimdKernelsAVX2();
+  else selected_kernels = &SimdKernelsAVX512();
+
+  return true;
+}
@@ -0,0 +1,15 @@
+/**
+* @brief Kernels built for sse4.2 - see the compile flags in CMakeLists.txt
+* @file simd_sse42.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#define SIMD_NAMESPACE simd_sse42
+#include "simd_kernels_impl.hpp"
+
+const SimdKernels& SimdKernelsSSE42() {
+  static const SimdKernels kernels = SIMD_NAMESPACE::MakeKernels<4>("sse4.2");
+  return kernels;
+}
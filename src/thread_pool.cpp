@@ -0,0 +1,122 @@
+/**
+* @brief Native thread pool, as an alternative to OpenMP
+* @file thread_pool.cpp
+* @author Benjamin Blundell <oni@section9.co.uk>
+* @date 19/10/2026
+*
+*/
+
+#include "thread_pool.hpp"
+
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+
+#include <omp.h>
+
+using namespace std;
+
+// Pin the calling thread to the n-th CPU we are allowed to run on
+
+static void PinToCore(unsigned int n) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return;
+  }
+
+  int num_allowed = CPU_COUNT(&allowed);
+  if (num_allowed == 0) {
+    return;
+  }
+
+  int target = n % num_allowed;
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      return;
+    }
+  }
+}
+
+ThreadPool::ThreadPool(unsigned int num_threads, bool pin) : job_(nullptr), generation_(0), remaining_(0), quit_(false) {
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    workers_.push_back(std::thread([this, i, pin]() {
+      if (pin) PinToCore(i);
+      Worker(i);
+    }));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  start_.notify_all();
+  for (std::thread &t : workers_) {
+    t.join();
+  }
+}
+
+void ThreadPool::Run(const std::function<void(unsigned int thread)> &job) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  job_ = &job;
+  remaining_ = workers_.size();
+  generation_++;
+  start_.notify_all();
+  done_.wait(lock, [this]() { return remaining_ == 0; });
+  job_ = nullptr;
+}
+
+// Sleep until a new job comes in, run it, then report back
+
+void ThreadPool::Worker(unsigned int thread) {
+  unsigned long seen = 0;
+
+  while (true) {
+    const std::function<void(unsigned int)> *job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_.wait(lock, [this, seen]() { return quit_ || generation_ != seen; });
+      if (quit_) return;
+      seen = generation_;
+      job = job_;
+    }
+
+    (*job)(thread);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--remaining_ == 0) {
+      done_.notify_one();
+    }
+  }
+}
+
+unsigned int NumThreads(const RaytraceOptions &options) {
+  if (options.threads > 0) {
+    return options.threads;
+  }
+  unsigned int cores = std::thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+}
+
+void RunParallel(const RaytraceOptions &options, const std::function<void(unsigned int thread)> &job) {
+
+  if (options.thread_pool) {
+    static std::unique_ptr<ThreadPool> pool;
+    if (!pool || pool->size() != NumThreads(options)) {
+      pool.reset(new ThreadPool(NumThreads(options), true));
+    }
+    pool->Run(job);
+    return;
+  }
+
+  #pragma omp parallel num_threads(NumThreads(options))
+  {
+    job(omp_get_thread_num());
+  }
+}
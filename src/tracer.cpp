@@ -9,6 +9,9 @@
 #include "tracer.hpp"
 #include "main.hpp"
 #include "string_utils.hpp"
+#include "morton.hpp"
+#include "integrator.hpp"
+#include "thread_pool.hpp"
 
 #ifdef _USE_WINDOW
 #include "window.hpp"
@@ -17,22 +20,12 @@
 #include <iostream>
 #include <ostream>
 #include <cstdlib>
+#include <algorithm>
+#include <mutex>
 
 using namespace std;
 using namespace s9;
 
-// A set of cached values we might need
-typedef struct {
-  glm::mat4 inv_view_proj;
-  float ffx;
-  float ffy;
-
-}Cache;
-
-
-// Pre-define
-glm::vec3 TraceRay(Ray ray, const Scene &scene);
-
 // Fire a ray from the origin through our virtual screen
 // We need to reverse the projection and such to get the ray into world space where we shall
 // work
@@ -103,98 +96,411 @@ glm refractionRay(Ray r, RayHit hit, const Scene &scene){
 
 
 
-// Trace a ray from the ray's origin to either a hit or its escape from the scene, returning a colour
-// Pretty much the meat of the RayTraceKernel
-glm::vec3 TraceRay(Ray ray, const RaytraceOptions &options, const Scene &scene, Cache &cache){
+// Features of a scene that the specialised TraceRay variants are built for. Anything
+// a scene lacks is compiled out of its variant
 
-  glm::vec3 accum_colour(1.0f,1.0f,1.0f);
+enum TraceFeatures {
+  TRACE_GROUND = 1,     // There is a ground plane
+  TRACE_GLOSSY = 2,     // At least one material has some shine or is glass
+  TRACE_LIGHTS = 4,     // There are lights to hit
+  TRACE_MESHES = 8,     // There are triangle meshes
+  TRACE_ALL = 15
+};
 
-  for (int i = 0; i < options.max_bounces; ++i){
-    
-    // Find the closest thing hit by this ray
-    float closest = MAX_DISTANCE;
-    RayHit hit, test_hit;
-     
-    std::shared_ptr<Material> hit_material = nullptr;
-
-    // lamba to do the setting of the hits
-    auto do_hit = [](RayHit &td, RayHit &h, float &c) { if (td.dist < c) { c = td.dist; h = td; return true;} return false; };
-
-    // Did we hit an object?
-    // For now we split between sphere and ground but eventually
-    // we will use pointers to RayIntersectFunc
-    for ( std::function<bool(const Ray &ray, RayHit &hit, std::shared_ptr<Material> &m)> rh : scene.intersection_funcs  ) { 
-      std::shared_ptr<Material> hm = nullptr; 
-      if( rh(ray,test_hit,hm)) {
-        if (do_hit(test_hit, hit, closest)){
-          hit_material = hm;
-        }
-      } 
-    }
+unsigned int SceneFeatures(const Scene &scene) {
+  unsigned int features = 0;
+
+  if (scene.ground) {
+    features |= TRACE_GROUND;
+    if (scene.ground->material->shiny > 0.0f) features |= TRACE_GLOSSY;
+  }
+
+  for (const std::shared_ptr<Sphere> &s : scene.spheres) {
+    if (s->material->shiny > 0.0f || s->material->ior > 0.0f) features |= TRACE_GLOSSY;
+  }
+
+  if (!scene.lights.empty()) {
+    features |= TRACE_LIGHTS;
+  }
+
+  for (const Instance &i : scene.instances) {
+    features |= TRACE_MESHES;
+    if (i.GetMaterial().shiny > 0.0f) features |= TRACE_GLOSSY;
+  }
+
+  return features;
+}
+
+// Scene::Intersect with the mesh, ground and light tests compiled in or out
 
-    // Test the ground to see if its closer
-    if (scene.ground->RayIntersection(ray, test_hit)){
-      if (do_hit(test_hit, hit, closest)){
-        hit_material = scene.ground->material;
+template <unsigned int Features>
+inline bool IntersectScene(const Ray &ray, const Scene &scene, PrimitiveHit &prim) {
+
+  float tmax = MAX_DISTANCE;
+  float dist;
+
+  int sphere = scene.IntersectSpheres(ray, tmax, dist);
+  if (sphere >= 0) {
+    tmax = dist;
+    prim.dist = dist;
+    prim.type = HIT_SPHERE;
+    prim.id = sphere;
+  }
+
+  if ((Features & TRACE_MESHES) && scene.IntersectMeshes(ray, tmax, prim)) {
+    tmax = prim.dist;
+  }
+
+  if ((Features & TRACE_GROUND) && scene.ground->Intersect(ray, tmax, dist)) {
+    tmax = dist;
+    prim.dist = dist;
+    prim.type = HIT_GROUND;
+  }
+
+  if ((Features & TRACE_LIGHTS) && !scene.light_bvh.Empty()) {
+    int light = scene.light_bvh.Intersect(ray, tmax, dist);
+    if (light >= 0) {
+      prim.dist = dist;
+      prim.type = HIT_LIGHT;
+      prim.id = light;
+    }
+  } else if (Features & TRACE_LIGHTS) {
+    for (size_t i = 0; i < scene.lights.size(); ++i) {
+      if (scene.lights[i]->Intersect(ray, tmax, dist)) {
+        tmax = dist;
+        prim.dist = dist;
+        prim.type = HIT_LIGHT;
+        prim.id = i;
       }
     }
+  }
+
+  return prim.type != HIT_NONE;
+}
+
+// Smallest GGX alpha. Below this the sampled normal can come out zero
+static const float GGX_MIN_ALPHA = 0.001f;
+
+static inline float GgxAlpha(const Material &material) {
+  return std::max(material.roughness * material.roughness, GGX_MIN_ALPHA);
+}
+
+// Smith masking for one direction, cos_theta from the normal
+static inline float SmithG1(float cos_theta, float alpha) {
+  float a2 = alpha * alpha;
+  return 2.0f * cos_theta / (cos_theta + sqrt(a2 + (1.0f - a2) * cos_theta * cos_theta));
+}
+
+// Chance per unit solid angle that ScatterGlossy sends a ray seen from wo towards wi,
+// which is G1(wo) D(m) / (4 cos wo). What the ray then carries - the BRDF times the
+// cosine - is that times G1(wi), and goes in value. Both are 0 below the surface
+
+static inline float GlossyPdf(const glm::vec3 &wo, const glm::vec3 &wi, const glm::vec3 &normal, float alpha, float &value) {
+  float cos_o = glm::dot(wo, normal);
+  float cos_i = glm::dot(wi, normal);
+  value = 0.0f;
+  if (cos_o <= 0.0f || cos_i <= 0.0f) {
+    return 0.0f;
+  }
+
+  float a2 = alpha * alpha;
+  float cos_m = glm::dot(glm::normalize(wo + wi), normal);
+  float d = cos_m * cos_m * (a2 - 1.0f) + 1.0f;
+  float pdf = SmithG1(cos_o, alpha) * a2 / (static_cast<float>(PI) * d * d) / (4.0f * cos_o);
+  value = pdf * SmithG1(cos_i, alpha);
+  return pdf;
+}
 
-    // But are the lights any closer?
+// Bounce off a glossy material by GGX microfacet reflection. The microfacet normal is
+// drawn from those visible from the incoming ray (Heitz 2018), so every sample lands
+// in the lobe, and all that is left of the BRDF over the pdf is the colour and the
+// masking of the way out. Returns that masking, or 0 if the ray ends up under the
+// surface, which is where the energy lost to rough surfaces goes
+
+inline float ScatterGlossy(Ray &ray, const RayHit &hit, const Material &material, float u1, float u2) {
+  glm::vec3 normal = glm::dot(ray.direction, hit.normal) > 0.0f ? -hit.normal : hit.normal;
+  float alpha = GgxAlpha(material);
+
+  // Frame around the normal, with the view pointing away from the surface
+  glm::vec3 major_axis = fabs(normal.x) < 0.9f ? glm::vec3(1.0f,0,0) : glm::vec3(0,1.0f,0);
+  glm::vec3 t = glm::normalize(glm::cross(major_axis, normal));
+  glm::vec3 b = glm::cross(normal, t);
+  glm::vec3 wo = -ray.direction;
+  glm::vec3 v(glm::dot(wo, t), glm::dot(wo, b), glm::dot(wo, normal));
+
+  // Stretch the view to unit roughness, pick a point on the half disc it sees, then
+  // lift it to the hemisphere and unstretch
+  glm::vec3 vh = glm::normalize(glm::vec3(alpha * v.x, alpha * v.y, v.z));
+  float lensq = vh.x * vh.x + vh.y * vh.y;
+  glm::vec3 t1 = lensq > 0.0f ? glm::vec3(-vh.y, vh.x, 0.0f) / sqrt(lensq) : glm::vec3(1.0f,0,0);
+  glm::vec3 t2 = glm::cross(vh, t1);
+
+  float r = sqrt(u1);
+  float phi = 2.0f * static_cast<float>(PI) * u2;
+  float p1 = r * cos(phi);
+  float p2 = r * sin(phi);
+  float s = 0.5f * (1.0f + vh.z);
+  p2 = (1.0f - s) * sqrt(std::max(0.0f, 1.0f - p1 * p1)) + s * p2;
+
+  glm::vec3 nh = t1 * p1 + t2 * p2 + vh * sqrt(std::max(0.0f, 1.0f - p1 * p1 - p2 * p2));
+  glm::vec3 m = glm::normalize(glm::vec3(alpha * nh.x, alpha * nh.y, std::max(0.0f, nh.z)));
+  glm::vec3 l = glm::reflect(-v, m);
+
+  if (l.z <= 0.0f) {
+    return 0.0f;
+  }
+
+  ray.direction = glm::normalize(t * l.x + b * l.y + normal * l.z);
+  ray.origin = hit.loc + normal * 0.001f;
+  ray.bounces++;
+  return SmithG1(l.z, alpha);
+}
+
+// Bounce off a diffuse material in the given direction
+
+inline void ScatterDiffuse(Ray &ray, const RayHit &hit, const glm::vec3 &diffuse_dir) {
+  ray.direction = diffuse_dir;
+  ray.origin = hit.loc;
+  ray.origin += hit.normal * 0.001f;
+  ray.bounces++;
+}
+
+// Reflect or refract at a dielectric, choosing by the Fresnel reflectance so the
+// weight needs no Fresnel term of its own. u picks which. Rays leaving the material
+// are tinted by what it absorbed on the way through, which is the weight returned.
+// inside is set if the ray carries on inside the material
+
+inline glm::vec3 ScatterDielectric(Ray &ray, const RayHit &hit, const Material &material, float u, bool &inside) {
+  bool was_inside = glm::dot(ray.direction, hit.normal) > 0.0f;
+  glm::vec3 normal = was_inside ? -hit.normal : hit.normal;
+  float eta = was_inside ? material.ior : 1.0f / material.ior;
+
+  float cos_i = std::min(-glm::dot(ray.direction, normal), 1.0f);
+  float sin2_t = eta * eta * (1.0f - cos_i * cos_i);
+
+  // Unpolarised, so the mean of the two polarisations. Past the critical angle it
+  // all reflects
+  float reflectance = 1.0f;
+  float cos_t = 0.0f;
+  if (sin2_t < 1.0f) {
+    cos_t = sqrt(1.0f - sin2_t);
+    float rs = (eta * cos_i - cos_t) / (eta * cos_i + cos_t);
+    float rp = (cos_i - eta * cos_t) / (cos_i + eta * cos_t);
+    reflectance = 0.5f * (rs * rs + rp * rp);
+  }
+
+  if (u < reflectance) {
+    ray.direction = glm::reflect(ray.direction, normal);
+    ray.origin = hit.loc + normal * 0.001f;
+    inside = was_inside;
+  } else {
+    ray.direction = glm::normalize(eta * ray.direction + (eta * cos_i - cos_t) * normal);
+    ray.origin = hit.loc - normal * 0.001f;
+    inside = !was_inside;
+  }
+  ray.bounces++;
+
+  if (was_inside) {
+    return glm::exp(-material.absorption * hit.dist);
+  }
+  return glm::vec3(1.0f,1.0f,1.0f);
+}
+
+// Bounce the ray off the material at the hit point, returning how much of the
+// material colour it carries on with. shiny is the chance of a glossy bounce, picked
+// by lobe, with u1 and u2 choosing its direction - otherwise the ray goes in
+// diffuse_dir. Glass uses lobe to choose between reflecting and refracting, and sets
+// inside. Unless nothing in the scene is shiny or glass, when both are compiled out
+// TODO we could move this into a diffuse material func?
+
+template <unsigned int Features>
+inline glm::vec3 ScatterRayVariant(Ray &ray, const RayHit &hit, const Material &material, const glm::vec3 &diffuse_dir,
+    float lobe, float u1, float u2, bool &inside) {
+
+  inside = false;
+  if ((Features & TRACE_GLOSSY) && material.ior > 0.0f) {
+    return ScatterDielectric(ray, hit, material, lobe, inside);
+  }
+
+  if ((Features & TRACE_GLOSSY) && lobe < material.shiny) {
+    return glm::vec3(ScatterGlossy(ray, hit, material, u1, u2));
+  }
+
+  ScatterDiffuse(ray, hit, diffuse_dir);
+  return glm::vec3(1.0f,1.0f,1.0f);
+}
 
-    std::shared_ptr<Light> light_hit;   
-    bool is_light_hit = false;
+glm::vec3 ScatterRay(Ray &ray, const RayHit &hit, const Material &material, bool &inside) {
+  float lobe = static_cast<float>(std::rand()) / RAND_MAX;
+  float u1 = static_cast<float>(std::rand()) / RAND_MAX;
+  float u2 = static_cast<float>(std::rand()) / RAND_MAX;
+  return ScatterRayVariant<TRACE_ALL>(ray, hit, material, HemisphereDiffuseRay(hit.normal), lobe, u1, u2, inside);
+}
+
+// Environment light is found two ways - by the bounces, and by shadow rays in
+// directions picked from the map. Each is weighted by how likely it was to find a
+// direction against the other (the power heuristic, Veach 1995), so the sun in a map
+// comes from the shadow rays and the wide dim sky mostly from the bounces. Glass
+// bounces are left to find it on their own
+
+static const float DIFFUSE_PDF = 1.0f / (2.0f * static_cast<float>(PI));
+
+static inline float PowerHeuristic(float pdf, float other) {
+  return pdf * pdf / (pdf * pdf + other * other);
+}
+
+// One shadow ray towards the map, for the lobe a bounce from wo took - glossy with
+// this alpha, or diffuse if it is 0
+
+static glm::vec3 EnvironmentLobe(const glm::vec3 &origin, const glm::vec3 &normal, const glm::vec3 &wo, float alpha,
+    const Scene &scene, bool mis) {
+  float u1 = static_cast<float>(std::rand()) / RAND_MAX;
+  float u2 = static_cast<float>(std::rand()) / RAND_MAX;
+  float u3 = static_cast<float>(std::rand()) / RAND_MAX;
+  float pdf;
+  glm::vec3 direction = scene.environment->Sample(std::min(u1, 0.99999994f), u2, u3, pdf);
+
+  if (pdf <= 0.0f || glm::dot(direction, normal) <= 0.0f) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  float value = DIFFUSE_PDF;
+  float bounce_pdf = alpha > 0.0f ? GlossyPdf(wo, direction, normal, alpha, value) : DIFFUSE_PDF;
+  if (value <= 0.0f || scene.Occluded(Ray(origin, direction), MAX_DISTANCE)) {
+    return glm::vec3(0.0f,0.0f,0.0f);
+  }
+
+  float weight = mis ? PowerHeuristic(pdf, bounce_pdf) : 1.0f;
+  return scene.environment->Lookup(direction) * (value / pdf * weight);
+}
+
+glm::vec3 EnvironmentLight(const glm::vec3 &origin, const glm::vec3 &normal, const Scene &scene, bool mis) {
+  return EnvironmentLobe(origin, normal, glm::vec3(0.0f), 0.0f, scene, mis);
+}
+
+// Trace a ray from the ray's origin to either a hit or its escape from the scene, returning a colour
+// Pretty much the meat of the RayTraceKernel. MaxBounces is either a compile time bounce
+// limit, so the loop can be unrolled, or 0 to use options.max_bounces
+
+template <unsigned int Features, int MaxBounces>
+glm::vec3 TraceRayVariant(Ray ray, const RaytraceOptions &options, const Scene &scene, Cache &cache){
+
+  glm::vec3 accum_colour(1.0f,1.0f,1.0f);
+  glm::vec3 env_colour(0.0f,0.0f,0.0f);    // Light found by shadow rays to the environment
+  const int max_bounces = MaxBounces > 0 ? MaxBounces : options.max_bounces;
+  int inside = -1;        // The glass sphere the ray is in, if any
+  float bounce_pdf = 0.0f;  // Of the last bounce, if the sky it finds is shared with shadow rays
+
+  for (int i = 0; i < max_bounces; ++i){
     
-    for ( std::shared_ptr<Light> h : scene.lights) { 
-      if( h->RayIntersection(ray,test_hit)) {
-        is_light_hit = true;
-        if (do_hit(test_hit, hit, closest)){
-          light_hit = h;
-        }
-      } 
+    // Find the closest thing hit by this ray
+    PrimitiveHit prim;
+
+    // Inside glass the only way is out through the far side, which the sphere tests
+    // dont see, as they ignore spheres hit from inside
+    if ((Features & TRACE_GLOSSY) && inside >= 0) {
+      prim.dist = scene.spheres[inside]->Exit(ray);
+      prim.type = HIT_SPHERE;
+      prim.id = inside;
+
+    // We hit empty space so break and go for the sky colour
+    } else if (!IntersectScene<Features>(ray, scene, prim)) {
+      break;
     }
 
     // If we hit a light we can return early
-    if (light_hit) { 
-      // Direct hit on the light
-      if (i==0){
-        glm::vec3 cc = light_hit->colour; 
-        return cc;
-      }
-      accum_colour *= light_hit->colour;
-      return accum_colour; 
+    if ((Features & TRACE_LIGHTS) && prim.type == HIT_LIGHT) { 
+      accum_colour *= scene.lights[prim.id]->colour;
+      return accum_colour + env_colour; 
     }
 
-   
-    // If we hit update the colour and go again, else add sky colour and break
-    // TODO we could move this into a diffuse material func?
-    if (hit_material != nullptr){
+    // If we hit update the colour and go again. Glossy bounces can be lost under the
+    // surface, and then the path carries nothing
+    RayHit hit;
+    const Material &material = scene.HitAttributes(ray, prim, hit);
+    glm::vec3 weight(1.0f,1.0f,1.0f);
+    glm::vec3 wo = -ray.direction;
+    bounce_pdf = 0.0f;
+
+    if ((Features & TRACE_GLOSSY) && material.ior > 0.0f) {
+      bool in;
+      weight = ScatterDielectric(ray, hit, material, static_cast<float>(std::rand()) / RAND_MAX, in);
+      inside = in ? prim.id : -1;
+    } else if ((Features & TRACE_GLOSSY) && material.shiny > 0.0f && static_cast<float>(std::rand()) / RAND_MAX < material.shiny) {
+      float u1 = static_cast<float>(std::rand()) / RAND_MAX;
+      float u2 = static_cast<float>(std::rand()) / RAND_MAX;
+      glm::vec3 normal = glm::dot(wo, hit.normal) < 0.0f ? -hit.normal : hit.normal;
+      float alpha = GgxAlpha(material);
+      if (scene.environment) {
+        env_colour += accum_colour * material.colour * EnvironmentLobe(hit.loc + normal * 0.001f, normal, wo, alpha, scene, true);
+      }
 
-      glm::vec3 reflected = glm::reflect(ray.direction, hit.normal);
-      ray.origin = hit.loc;
-      ray.origin += hit.normal * 0.001f;
-    
-      // Now we need to check the material and fire off a load of diffuse rays depending on shiny
-      glm::vec3 diffuse_dir = HemisphereDiffuseRay(hit.normal);
-      ray.direction = (diffuse_dir * (1.0f - hit_material->shiny)) + (reflected *  hit_material->shiny);  
-      ray.direction = glm::normalize(ray.direction);
-      accum_colour *= hit_material->colour;
-    }
-    else {
-      // We hit empty space so break and go for the sky colour
-      break;
+      weight = glm::vec3(ScatterGlossy(ray, hit, material, u1, u2));
+      if (weight.x <= 0.0f) {
+        return env_colour;
+      }
+      if (scene.environment) {
+        float value;
+        bounce_pdf = GlossyPdf(wo, ray.direction, normal, alpha, value);
+      }
+    } else {
+      if (scene.environment) {
+        env_colour += accum_colour * material.colour * EnvironmentLight(hit.loc + hit.normal * 0.001f, hit.normal, scene, true);
+      }
+      ScatterDiffuse(ray, hit, HemisphereDiffuseRay(hit.normal));
+      bounce_pdf = DIFFUSE_PDF;
     }
-    
+
+    accum_colour *= material.colour * weight;
   }
   // Return the sky colour - although it may not have hit the sky if its bounced around a lot
 
-  accum_colour *= scene.sky_colour;
+  accum_colour *= scene.Sky(ray.direction);
+  if (bounce_pdf > 0.0f && scene.environment) {
+    accum_colour *= PowerHeuristic(bounce_pdf, scene.environment->Pdf(ray.direction));
+  }
   
-  return accum_colour;
+  return accum_colour + env_colour;
+
+}
+
+glm::vec3 TraceRay(Ray ray, const RaytraceOptions &options, const Scene &scene, Cache &cache){
+  return TraceRayVariant<TRACE_ALL, 0>(ray, options, scene, cache);
+}
+
+// Pick the variant for a scene's features. Only the default bounce limit and single
+// bounces get their own fixed count variants
 
+template <unsigned int Features>
+TraceRayFunc SelectTraceRayBounces(unsigned int max_bounces) {
+  if (max_bounces == 1) return &TraceRayVariant<Features, 1>;
+  if (max_bounces == 10) return &TraceRayVariant<Features, 10>;
+  return &TraceRayVariant<Features, 0>;
+}
+
+TraceRayFunc SelectTraceRay(unsigned int features, unsigned int max_bounces) {
+  switch (features) {
+    case 0 : return SelectTraceRayBounces<0>(max_bounces);
+    case 1 : return SelectTraceRayBounces<1>(max_bounces);
+    case 2 : return SelectTraceRayBounces<2>(max_bounces);
+    case 3 : return SelectTraceRayBounces<3>(max_bounces);
+    case 4 : return SelectTraceRayBounces<4>(max_bounces);
+    case 5 : return SelectTraceRayBounces<5>(max_bounces);
+    case 6 : return SelectTraceRayBounces<6>(max_bounces);
+    case 7 : return SelectTraceRayBounces<7>(max_bounces);
+    case 8 : return SelectTraceRayBounces<8>(max_bounces);
+    case 9 : return SelectTraceRayBounces<9>(max_bounces);
+    case 10 : return SelectTraceRayBounces<10>(max_bounces);
+    case 11 : return SelectTraceRayBounces<11>(max_bounces);
+    case 12 : return SelectTraceRayBounces<12>(max_bounces);
+    case 13 : return SelectTraceRayBounces<13>(max_bounces);
+    case 14 : return SelectTraceRayBounces<14>(max_bounces);
+    default : return SelectTraceRayBounces<TRACE_ALL>(max_bounces);
+  }
 }
 
 
-inline float  maxc (float x) { return x > 1.0f ? 1.0f : x; }
+static inline float  maxc (float x) { return x > 1.0f ? 1.0f : x; }
 glm::vec3 maxv (glm::vec3 v) { return glm::vec3(maxc(v.x), maxc(v.y), maxc(v.z)); }
 
 // Fire multiple rays for a pixel and combine to make up the final colour
@@ -217,7 +523,7 @@ glm::vec3 FireRays(int x, int y, const RaytraceOptions &options, const Scene &sc
     
     for (int j=0; j < options.num_rays_per_pixel; ++j){
       Ray ray = GenerateRay(float(x) + rx, float(y) + ry, options, camera, cache);
-      pixel_colour_inner += TraceRay(ray, options, scene, cache) * options.ray_intensity;
+      pixel_colour_inner += cache.trace_ray(ray, options, scene, cache) * options.ray_intensity;
     }
   
     pixel_colour_inner = maxv(pixel_colour_inner);
@@ -232,7 +538,7 @@ glm::vec3 FireRays(int x, int y, const RaytraceOptions &options, const Scene &sc
 
 // Create a cache to hopefully speed things up
 
-void CreateCache(const Scene &scene, Cache &cache) {
+void CreateCache(const Scene &scene, const RaytraceOptions &options, Cache &cache) {
 
   float ffx = tan(scene.camera->fov() / 2.0f);
   float ratio = scene.camera->width() / scene.camera->height();
@@ -241,6 +547,215 @@ void CreateCache(const Scene &scene, Cache &cache) {
   cache.ffx = ffx;
   cache.ffy = ffy;
   cache.inv_view_proj = glm::inverse(scene.camera->view()) * glm::inverse(scene.camera->projection());
+
+  // Bounds of everything finite in the scene. The ground is infinite so rays leaving
+  // the bounds just get clamped to the edge cells when we sort them
+  glm::vec3 bmin = scene.camera->position();
+  glm::vec3 bmax = bmin;
+
+  for (const std::shared_ptr<Sphere> &s : scene.spheres) {
+    bmin = glm::min(bmin, s->centre - glm::vec3(s->radius));
+    bmax = glm::max(bmax, s->centre + glm::vec3(s->radius));
+  }
+
+  for (const std::shared_ptr<Light> &l : scene.lights) {
+    bmin = glm::min(bmin, l->pos - glm::vec3(l->radius));
+    bmax = glm::max(bmax, l->pos + glm::vec3(l->radius));
+  }
+
+  for (const Instance &i : scene.instances) {
+    BoundingBox b = i.Bounds();
+    bmin = glm::min(bmin, b.min);
+    bmax = glm::max(bmax, b.max);
+  }
+
+  cache.bounds_min = bmin;
+  cache.bounds_inv_size = 1.0f / glm::max(bmax - bmin, glm::vec3(EPSILON));
+
+  cache.trace_ray = SelectTraceRay(SceneFeatures(scene), options.max_bounces);
+}
+
+// A path in flight in the batched kernel
+
+struct PathState {
+  Ray ray;
+  glm::vec3 colour;       // Colour accumulated along the path so far
+  unsigned int sample;    // The supersample slot this path adds its colour into
+  int inside;             // The glass sphere the ray is in, or -1
+};
+
+// Sort key for a ray - the direction octant in the top bits and a morton code of
+// the origin below. Rays with similar keys touch the same geometry
+
+inline uint64_t RaySortKey(const Ray &ray, const Cache &cache) {
+  uint64_t octant = (ray.direction.x < 0.0f ? 1 : 0) | (ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 4 : 0);
+  uint32_t morton = Morton3D((ray.origin - cache.bounds_min) * cache.bounds_inv_size);
+  return (octant << 30) | morton;
+}
+
+// Reorder the paths so consecutive rays are spatially coherent. keys and scratch
+// are passed in so each thread can reuse its allocations between bounces
+
+void SortPaths(std::vector<PathState> &paths, std::vector< std::pair<uint64_t, uint32_t> > &keys, std::vector<PathState> &scratch, const Cache &cache) {
+  keys.resize(paths.size());
+  for (size_t k = 0; k < paths.size(); ++k) {
+    keys[k] = std::make_pair(RaySortKey(paths[k].ray, cache), static_cast<uint32_t>(k));
+  }
+
+  std::sort(keys.begin(), keys.end());
+
+  scratch.resize(paths.size());
+  for (size_t k = 0; k < keys.size(); ++k) {
+    scratch[k] = paths[keys[k].second];
+  }
+  paths.swap(scratch);
+}
+
+// Batched version of the kernel. Rather than tracing each ray to completion, all the
+// rays for a row are advanced one bounce at a time. With sort_rays set, the secondary
+// rays are reordered between bounces - after the first diffuse bounce the directions
+// are random, so this keeps consecutive intersection tests on the same geometry.
+// Environment maps are only found by the bounces here, without shadow rays
+
+void RaytraceKernelBatched(RaytraceBitmap &bitmap, const RaytraceOptions &options, const Scene &scene, Cache &cache) {
+
+  WorkQueue rows(options.height);
+
+  RunParallel(options, [&](unsigned int thread) {
+    std::vector<PathState> paths, scratch;
+    std::vector< std::pair<uint64_t, uint32_t> > keys;
+    std::vector<glm::vec3> samples;
+    std::vector<float> row(options.width * 3);
+
+    // Scratch for scattering all the surviving paths at once with the SIMD kernels
+    const SimdKernels &kernels = *scene.kernels;
+    SimdRandom rng(thread + 1);
+    std::vector<RayHit> hits;
+    std::vector<const Material*> materials;
+    std::vector<float> nx, ny, nz, u1, u2, lobe, dx, dy, dz;
+
+    int i;
+    while (rows.Next(i)) {
+
+      samples.assign(options.width * options.supersample, glm::vec3(0.0f,0.0f,0.0f));
+      paths.clear();
+
+      // Primary rays - same sampling pattern as FireRays
+      for (int j = 0; j < options.width; ++j ) {
+        for (int s = 0; s < options.supersample; ++s){
+          float rx = ((static_cast<float>(std::rand()) / RAND_MAX) - 0.5f);
+          float ry = ((static_cast<float>(std::rand()) / RAND_MAX) - 0.5f);
+
+          for (int r = 0; r < options.num_rays_per_pixel; ++r){
+            PathState path;
+            path.ray = GenerateRay(float(j) + rx, float(i) + ry, options, scene.camera, cache);
+            path.colour = glm::vec3(1.0f,1.0f,1.0f);
+            path.sample = j * options.supersample + s;
+            path.inside = -1;
+            paths.push_back(path);
+          }
+        }
+      }
+
+      for (int b = 0; b < options.max_bounces && !paths.empty(); ++b){
+
+        if (options.sort_rays && b > 0) {
+          SortPaths(paths, keys, scratch, cache);
+        }
+
+        // Advance every path one bounce, compacting the survivors to the front
+        size_t alive = 0;
+        hits.clear();
+        materials.clear();
+
+        for (size_t k = 0; k < paths.size(); ++k){
+          PathState &path = paths[k];
+          PrimitiveHit prim;
+
+          if (path.inside >= 0) {
+            prim.dist = scene.spheres[path.inside]->Exit(path.ray);
+            prim.type = HIT_SPHERE;
+            prim.id = path.inside;
+          }
+
+          if (prim.type == HIT_NONE && !scene.Intersect(path.ray, MAX_DISTANCE, prim)) {
+            samples[path.sample] += path.colour * scene.Sky(path.ray.direction) * options.ray_intensity;
+          } else if (prim.type == HIT_LIGHT) {
+            samples[path.sample] += path.colour * scene.lights[prim.id]->colour * options.ray_intensity;
+          } else {
+            RayHit hit;
+            materials.push_back(&scene.HitAttributes(path.ray, prim, hit));
+            hits.push_back(hit);
+            path.inside = prim.type == HIT_SPHERE ? prim.id : -1;
+            paths[alive++] = path;
+          }
+        }
+        paths.resize(alive);
+
+        // New diffuse directions for all the survivors in one go
+        size_t padded = (alive + SIMD_MAX_WIDTH - 1) / SIMD_MAX_WIDTH * SIMD_MAX_WIDTH;
+        nx.assign(padded, 0.0f);
+        ny.assign(padded, 0.0f);
+        nz.assign(padded, 1.0f);
+        u1.resize(padded);
+        u2.resize(padded);
+        lobe.resize(padded);
+        dx.resize(padded);
+        dy.resize(padded);
+        dz.resize(padded);
+
+        for (size_t k = 0; k < alive; ++k){
+          nx[k] = hits[k].normal.x;
+          ny[k] = hits[k].normal.y;
+          nz[k] = hits[k].normal.z;
+        }
+
+        kernels.random_floats(rng, u1.data(), padded);
+        kernels.random_floats(rng, u2.data(), padded);
+        kernels.sample_hemisphere(nx.data(), ny.data(), nz.data(), u1.data(), u2.data(), dx.data(), dy.data(), dz.data(), padded);
+
+        // Glossy paths reuse the numbers drawn for the diffuse direction they dont need,
+        // and any lost under the surface are dropped
+        kernels.random_floats(rng, lobe.data(), padded);
+        size_t kept = 0;
+        for (size_t k = 0; k < alive; ++k){
+          bool in;
+          glm::vec3 weight = ScatterRayVariant<TRACE_GLOSSY>(paths[k].ray, hits[k], *materials[k], glm::vec3(dx[k], dy[k], dz[k]),
+              lobe[k], u1[k], u2[k], in);
+          paths[k].inside = in ? paths[k].inside : -1;
+          if (weight.x > 0.0f) {
+            paths[k].colour *= materials[k]->colour * weight;
+            paths[kept++] = paths[k];
+          }
+        }
+        paths.resize(kept);
+      }
+
+      // Anything still bouncing gets the sky colour, as in TraceRay
+      for (const PathState &path : paths) {
+        samples[path.sample] += path.colour * scene.Sky(path.ray.direction) * options.ray_intensity;
+      }
+
+      for (int j = 0; j < options.width; ++j ) {
+        glm::vec3 pixel_colour(0.0f,0.0f,0.0f);
+        for (int s = 0; s < options.supersample; ++s){
+          pixel_colour += maxv(samples[j * options.supersample + s]);
+        }
+        pixel_colour /= static_cast<float>(options.supersample);
+        row[j * 3] = pixel_colour.x;
+        row[j * 3 + 1] = pixel_colour.y;
+        row[j * 3 + 2] = pixel_colour.z;
+      }
+
+      kernels.tonemap(row.data(), &bitmap.data[i * options.width * 4], options.width);
+
+#ifdef _USE_WINDOW
+      if (options.live){
+        UpdateImage(options);
+      }
+#endif
+    }
+  });
 }
 
 // The Core of the Raytracer for an entire frame
@@ -248,23 +763,60 @@ void CreateCache(const Scene &scene, Cache &cache) {
 void RaytraceKernel(RaytraceBitmap  &bitmap, const RaytraceOptions &options, const Scene &scene ) {
 
   Cache cache;
-  CreateCache(scene,cache);
-
-  #pragma omp parallel for
-  for (int i = 0; i < options.height; ++i ){
-    for (int j = 0; j < options.width; ++j ) {
-      int x = j;
-      int y = i;
-      glm::vec3 ray_colour = FireRays(x, y, options, scene, cache);
-      bitmap.SetRGB(x,y,ray_colour.x, ray_colour.y, ray_colour.z); 
+  CreateCache(scene,options,cache);
+
+  // Kept from frame to frame, for integrators that carry anything over
+  static std::shared_ptr<Integrator> integrator;
+  if (!integrator || integrator->Name() != options.integrator) {
+    integrator = CreateIntegrator(options.integrator);
+    if (!integrator) {
+      std::cout << "Unknown integrator " << options.integrator << " - using path" << std::endl;
+      integrator = CreateIntegrator("path");
     }
+  }
+
+  // Batching only applies to the full path tracer
+  if ((options.batched || options.sort_rays) && integrator->Name() == "path") {
+    RaytraceKernelBatched(bitmap, options, scene, cache);
+    return;
+  }
+
+  integrator->BeginFrame(options, scene, cache);
+
+  OccluderCache shadow_stats;
+  std::mutex stats_mutex;
+
+  WorkQueue rows(options.height);
+
+  RunParallel(options, [&](unsigned int thread) {
+    OccluderCache shadows(scene.lights.size());
+    std::vector<float> row(options.width * 3);
+
+    int i;
+    while (rows.Next(i)) {
+      for (int j = 0; j < options.width; ++j ) {
+        int x = j;
+        int y = i;
+        glm::vec3 ray_colour = integrator->Pixel(x, y, options, scene, cache, shadows);
+        row[x * 3] = ray_colour.x;
+        row[x * 3 + 1] = ray_colour.y;
+        row[x * 3 + 2] = ray_colour.z;
+      }
+
+      // Clamp and convert the whole row to bytes at once
+      scene.kernels->tonemap(row.data(), &bitmap.data[i * options.width * 4], options.width);
 #ifdef _USE_WINDOW
       if (options.live){
         UpdateImage(options);
       }
 #endif
+    }
 
-  } 
-}
-
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    shadow_stats.Merge(shadows);
+  });
 
+  if (shadow_stats.queries > 0) {
+    std::cout << "Shadow rays: " << shadow_stats.queries << " occluder cache hit rate: " << shadow_stats.HitRate() * 100.0f << "%" << std::endl;
+  }
+}